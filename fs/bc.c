@@ -1,13 +1,61 @@
 
 #include "fs.h"
 
+// The block cache holds at most bc_limit blocks besides the superblock
+// and bitmap, which stay in memory.  bc_slots lists the cached blocks;
+// when it is full, bc_evict picks a victim with the CLOCK algorithm,
+// using the PTE_A bit the hardware sets on each access.
+static uint32_t bc_slots[BC_MAXBLOCKS];
+static uint32_t bc_nslots;		// Slots in use
+static uint32_t bc_hand;		// Next slot CLOCK looks at
+static uint32_t bc_limit = BC_MAXBLOCKS;
+
+struct Fsstats fs_stats;
+
+// A run of blocks in flight, being read into its staging pages: read
+// ahead, or a block a worker missed on
+struct bc_io {
+	uint32_t io_blockno;		// First block
+	uint32_t io_n;			// Blocks, or 0 if this one is free
+	bool io_demand;			// Read for a worker's miss?
+	struct ide_req io_req;
+};
+static struct bc_io bc_ios[BC_NIO];
+
+// Blocks written since they were last flushed.  A block is in the set
+// if its bit in bc_dirtybits is set; bc_dirtylist lists the blocks in
+// the set in the order they were first written, with the time of that
+// write in bc_dirtytime.  The list may also hold stale entries for
+// blocks that have been flushed since, or twice for blocks written
+// again after that.
+static uint32_t bc_dirtybits[DISKSIZE / BLKSIZE / 32];
+static uint32_t bc_dirtylist[BC_MAXBLOCKS + BC_MAXPINNED];
+static uint32_t bc_dirtytime[BC_MAXBLOCKS + BC_MAXPINNED];
+static uint32_t bc_ndirty;		// Entries in bc_dirtylist
+static uint32_t bc_ndirtyset;		// Blocks in the set
+
+// The flusher writes back blocks that have been dirty for bc_maxage
+// msec.  bc_clock is the time it last looked, which is close enough to
+// stamp newly dirty blocks with.
+static uint32_t bc_maxage = FLUSH_MAXAGE;
+static uint32_t bc_clock;
+
+// Where bc_pgfault sends a worker to wait for a block (wswitch.S)
+void bc_fetch_upcall(void);
+
+#define BLOCKVA(blockno)	((void *) (DISKMAP + (blockno) * BLKSIZE))
+#define IOVA(io, i)		((void *) (BCSTAGE + \
+				 (((io) - bc_ios) * RA_MAXBLOCKS + (i)) * BLKSIZE))
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
 {
+	if (blockno >= TMPFS_BLK0)
+		return tmpfs_addr(blockno);
 	if (blockno == 0 || (super && blockno >= super->s_nblocks))
 		panic("bad block number %08x in diskaddr", blockno);
-	return (char*) (DISKMAP + blockno * BLKSIZE);
+	return BLOCKVA(blockno);
 }
 
 // Is this virtual address mapped?
@@ -24,15 +72,260 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+// Has this block been written since it was last flushed?
+bool
+block_is_dirty(uint32_t blockno)
+{
+	return (bc_dirtybits[blockno / 32] & (1 << (blockno % 32))) != 0;
+}
+
+static void
+bc_undirty(uint32_t blockno)
+{
+	if (block_is_dirty(blockno)) {
+		bc_dirtybits[blockno / 32] &= ~(1 << (blockno % 32));
+		bc_ndirtyset--;
+	}
+}
+
+// Drop the stale and duplicate entries from bc_dirtylist, and blocks
+// that are no longer mapped.  Of a block's entries the last one is
+// kept, since it has the time of the latest write that dirtied it.
+static void
+bc_dirty_compact(void)
+{
+	uint32_t i, k, blockno;
+
+	// Walk backwards, packing the entries we keep against the end
+	for (i = k = bc_ndirty; i-- > 0; ) {
+		blockno = bc_dirtylist[i];
+		if (!block_is_dirty(blockno))
+			continue;
+		bc_undirty(blockno);
+		if (va_is_mapped(BLOCKVA(blockno))) {
+			k--;
+			bc_dirtylist[k] = blockno;
+			bc_dirtytime[k] = bc_dirtytime[i];
+		}
+	}
+	bc_ndirty -= k;
+	memmove(bc_dirtylist, bc_dirtylist + k, bc_ndirty * sizeof(bc_dirtylist[0]));
+	memmove(bc_dirtytime, bc_dirtytime + k, bc_ndirty * sizeof(bc_dirtytime[0]));
+	for (i = 0; i < bc_ndirty; i++)
+		bc_dirtybits[bc_dirtylist[i] / 32] |= 1 << (bc_dirtylist[i] % 32);
+	bc_ndirtyset = bc_ndirty;
+}
+
+// Note that the block containing addr has been written, so that the
+// next bc_sync writes it back.  Code that writes to a cached block
+// must call this after the write.
+void
+bc_dirty(void *addr)
+{
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+
+	// The tmpfs is never written back
+	if (tmpfs_owns(addr))
+		return;
+	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
+		panic("bc_dirty of bad va %08x", addr);
+	if (block_is_dirty(blockno))
+		return;
+
+	if (bc_ndirty == ARRAY_SIZE(bc_dirtylist))
+		bc_dirty_compact();
+	assert(bc_ndirty < ARRAY_SIZE(bc_dirtylist));
+	bc_dirtybits[blockno / 32] |= 1 << (blockno % 32);
+	bc_ndirtyset++;
+	bc_dirtytime[bc_ndirty] = bc_clock;
+	bc_dirtylist[bc_ndirty++] = blockno;
+}
+
+// Set how long a block may stay dirty before the flusher writes it back.
+void
+bc_set_max_age(uint32_t msec)
+{
+	bc_maxage = msec;
+}
+
+// Is this block kept in memory for good?  The superblock and bitmap are
+// needed to handle every miss, so they are never evicted.
+static bool
+bc_pinned(uint32_t blockno)
+{
+	return !super || blockno < 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+}
+
+// Write back and unmap the cached block at va.
+static void
+bc_drop(void *va)
+{
+	int r;
+
+	flush_block(va);
+	if ((r = sys_page_unmap(0, va)) < 0)
+		panic("in bc_drop, sys_page_unmap: %e", r);
+	fs_stats.bc_evictions++;
+}
+
+// Free a slot with the CLOCK algorithm and return its index.
+// A block accessed since the hand last passed gets a second chance: its
+// PTE_A bit is cleared (writing it back first if it is dirty, since
+// remapping the page clears PTE_D as well).  Blocks in the running
+// journal transaction are passed over.  If they are all there is --
+// the hand has gone all the way round without meeting another -- the
+// transaction is committed; but if requests are in progress, it cannot
+// be, and bc_evict returns bc_nslots instead of a slot.
+static uint32_t
+bc_evict(void)
+{
+	uint32_t i, nrun = 0;	// pending slots passed in a row
+	void *va;
+	int r;
+
+	while (1) {
+		i = bc_hand;
+		bc_hand = (bc_hand + 1) % bc_nslots;
+		va = BLOCKVA(bc_slots[i]);
+
+		// Already unmapped behind our back
+		if (!va_is_mapped(va))
+			return i;
+
+		if (!journal_pending(bc_slots[i]))
+			nrun = 0;
+		else if (++nrun < bc_nslots)
+			continue;
+		else if (!journal_try_commit())
+			return bc_nslots;
+
+		if (!(uvpt[PGNUM(va)] & PTE_A)) {
+			bc_drop(va);
+			return i;
+		}
+
+		if (va_is_dirty(va))
+			flush_block(va);
+		else if ((r = sys_page_map(0, va, 0, va, uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+			panic("in bc_evict, sys_page_map: %e", r);
+	}
+}
+
+// Give blockno a slot, evicting another block if the cache is full.
+// While every cached block waits for a commit, the cache goes over its
+// limit instead.
+static void
+bc_slot_add(uint32_t blockno)
+{
+	uint32_t i;
+
+	if (bc_pinned(blockno))
+		return;
+	if (bc_nslots < bc_limit || (i = bc_evict()) == bc_nslots) {
+		assert(bc_nslots < BC_MAXBLOCKS);
+		bc_slots[bc_nslots++] = blockno;
+	} else
+		bc_slots[i] = blockno;
+	fs_stats.bc_resident = bc_nslots;
+}
+
+// Limit the block cache to nblocks blocks (BC_MINBLOCKS to BC_MAXBLOCKS),
+// evicting blocks if it holds more.  Blocks waiting for a commit that
+// cannot happen yet stay, and the cache shrinks as they are evicted.
+void
+bc_set_limit(uint32_t nblocks)
+{
+	nblocks = MAX(BC_MINBLOCKS, MIN(nblocks, BC_MAXBLOCKS));
+	if (bc_nslots > nblocks)
+		journal_try_commit();
+	while (bc_nslots > nblocks && !journal_pending(bc_slots[bc_nslots - 1])) {
+		bc_nslots--;
+		if (va_is_mapped(BLOCKVA(bc_slots[bc_nslots])))
+			bc_drop(BLOCKVA(bc_slots[bc_nslots]));
+	}
+	bc_limit = nblocks;
+	bc_hand = 0;
+	fs_stats.bc_limit = bc_limit;
+	fs_stats.bc_resident = bc_nslots;
+}
+
+// Return the read-ahead run in flight that holds blockno, or NULL.
+static struct bc_io *
+bc_inflight(uint32_t blockno)
+{
+	struct bc_io *io;
+
+	for (io = bc_ios; io < bc_ios + BC_NIO; io++)
+		if (io->io_n && blockno - io->io_blockno < io->io_n)
+			return io;
+	return NULL;
+}
+
+// Is blockno in the cache, or on its way?
+bool
+block_is_cached(uint32_t blockno)
+{
+	return va_is_mapped(BLOCKVA(blockno)) || bc_inflight(blockno);
+}
+
+// Wait for read-ahead run io to arrive, then map its blocks into the
+// cache.  If the read failed, the blocks are left to be read again
+// when they are used.
+static void
+bc_io_finish(struct bc_io *io)
+{
+	uint32_t i, n = io->io_n;
+	void *va;
+	int r;
+
+	ide_wait(&io->io_req);
+	io->io_n = 0;
+	worker_wakeup();
+	if (io->io_demand && io->io_req.ir_result < 0)
+		panic("Error - block read failed %e", io->io_req.ir_result);
+
+	for (i = 0; i < n && io->io_req.ir_result == 0; i++) {
+		va = BLOCKVA(io->io_blockno + i);
+		bc_slot_add(io->io_blockno + i);
+		if ((r = sys_page_map(0, IOVA(io, i), 0, va, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_io_finish, sys_page_map: %e", r);
+		// Set PTE_A so CLOCK passes over the blocks of this run
+		// while we make room for the rest of it
+		*(volatile char *) va;
+	}
+
+	// Clear PTE_A again: the blocks have not been used yet
+	for (i = 0; i < n && io->io_req.ir_result == 0; i++) {
+		va = BLOCKVA(io->io_blockno + i);
+		if ((r = sys_page_map(0, va, 0, va, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_io_finish, sys_page_map: %e", r);
+	}
+	if (io->io_req.ir_result == 0 && !io->io_demand)
+		fs_stats.bc_readahead += n;
+
+	for (i = 0; i < n; i++)
+		sys_page_unmap(0, IOVA(io, i));
+}
+
 // Fault any disk block that is read in to memory by
-// loading it from disk.
+// loading it from disk, evicting another block if the
+// cache is full.
 static void
 bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	struct bc_io *io;
+	uint32_t *esp;
 	int r;
 
+	// Pages shared with the flush timer we forked are copy-on-write
+	if ((addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
+	    && (uvpd[PDX(addr)] & PTE_P) && (uvpt[PGNUM(addr)] & PTE_COW)) {
+		cow_pgfault(utf);
+		return;
+	}
+
 	// Check that the fault was within the block cache region
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
 		panic("page fault in FS: eip %08x, va %08x, err %04x",
@@ -42,6 +335,34 @@ bc_pgfault(struct UTrapframe *utf)
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
 
+	// A worker waits for the block without holding up the others:
+	// have it return from the fault into bc_fetch_upcall, which
+	// calls bc_fetch on the worker's stack and then runs the faulting
+	// instruction again.  The block must be in use, as below; the
+	// bitmap is in memory by the time any worker runs, so this can
+	// be checked before the block is read.
+	if (worker_self()) {
+		if (bitmap && block_is_free(blockno))
+			panic("reading free block %08x\n", blockno);
+		esp = (uint32_t *) utf->utf_esp;
+		*--esp = utf->utf_eip;
+		*--esp = blockno;
+		utf->utf_esp = (uint32_t) esp;
+		utf->utf_eip = (uint32_t) bc_fetch_upcall;
+		return;
+	}
+
+	// The block may already be on its way
+	if ((io = bc_inflight(blockno))) {
+		bc_io_finish(io);
+		if (va_is_mapped(addr))
+			return;
+	}
+
+	// Make room for the block
+	bc_slot_add(blockno);
+	fs_stats.bc_misses++;
+
 	// Allocate a page in the disk map region, read the contents
 	// of the block from the disk into that page.
 	// Hint: first round addr to page boundary. fs/ide.c has code to read
@@ -70,6 +391,86 @@ bc_pgfault(struct UTrapframe *utf)
 		panic("reading free block %08x\n", blockno);
 }
 
+// Start reading the n blocks starting at blockno into a free run's
+// staging pages with a single disk command, and return the run.
+// Returns NULL if BC_NIO runs are already in flight.
+static struct bc_io *
+bc_io_start(uint32_t blockno, uint32_t n, bool demand)
+{
+	struct bc_io *io;
+	uint32_t i;
+	int r;
+
+	for (io = bc_ios; io < bc_ios + BC_NIO && io->io_n; io++)
+		/* do nothing */;
+	if (io == bc_ios + BC_NIO)
+		return NULL;
+
+	for (i = 0; i < n; i++)
+		if ((r = sys_page_alloc(0, IOVA(io, i), PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_io_start, sys_page_alloc: %e", r);
+
+	io->io_blockno = blockno;
+	io->io_n = n;
+	io->io_demand = demand;
+	memset(&io->io_req, 0, sizeof(io->io_req));
+	io->io_req.ir_secno = BLKSECTS * blockno;
+	io->io_req.ir_nsecs = BLKSECTS * n;
+	io->io_req.ir_va = IOVA(io, 0);
+	ide_submit(&io->io_req);
+	return io;
+}
+
+// Start reading the n blocks starting at blockno, none of which may be
+// cached or on their way yet, with a single disk command.  They are
+// read into staging pages, and moved into the cache by bc_poll or when
+// they are first used.  Reads fewer blocks if n is more than
+// RA_MAXBLOCKS or half the cache, and none if BC_NIO runs are already
+// in flight.
+void
+bc_readahead(uint32_t blockno, uint32_t n)
+{
+	n = MIN(n, MIN(RA_MAXBLOCKS, bc_limit / 2));
+	if (n == 0 || blockno + n > super->s_nblocks)
+		return;
+	bc_io_start(blockno, n, 0);
+}
+
+// Bring blockno into the cache for the worker that missed on it.  The
+// block is read in the background, and the other workers run until it
+// arrives.
+void
+bc_fetch(uint32_t blockno)
+{
+	struct bc_io *io;
+	bool waited = 0;
+
+	while (!va_is_mapped(BLOCKVA(blockno))) {
+		if (!(io = bc_inflight(blockno))
+		    && (io = bc_io_start(blockno, 1, 1)))
+			fs_stats.bc_misses++;
+		if (io && io->io_req.ir_done) {
+			bc_io_finish(io);
+			continue;
+		}
+		if (!waited)
+			fs_stats.wk_waits++;
+		waited = 1;
+		worker_wait();
+	}
+}
+
+// Move read-ahead runs that have arrived into the cache.
+void
+bc_poll(void)
+{
+	struct bc_io *io;
+
+	for (io = bc_ios; io < bc_ios + BC_NIO; io++)
+		if (io->io_n && io->io_req.ir_done)
+			bc_io_finish(io);
+}
+
 // Flush the contents of the block containing VA out to disk if
 // necessary, then clear the PTE_D bit using sys_page_map.
 // If the block is not in the block cache or is not dirty, does
@@ -83,9 +484,18 @@ flush_block(void *addr)
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
 	int r = 0;
 
+	if (tmpfs_owns(addr))
+		return;
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
 		panic("flush_block of bad va %08x", addr);
 
+	// A block in the running transaction may only go out with it, once
+	// no request is half done
+	if (journal_pending(blockno)) {
+		journal_try_commit();
+		return;
+	}
+
 	uintptr_t lo_addr = ROUNDDOWN((uintptr_t)addr, BLKSIZE);
 	if (va_is_mapped((void *)lo_addr) && va_is_dirty((void *)lo_addr))
 	{
@@ -93,6 +503,8 @@ flush_block(void *addr)
 		{
 			panic ("Error - failed to flush block to disk %e", r);
 		}
+		fs_stats.bc_writebacks++;
+		bc_undirty(blockno);
 
 		if ((r = sys_page_map(0, (void *)lo_addr, 0, (void *)lo_addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
 		{
@@ -102,6 +514,123 @@ flush_block(void *addr)
 
 }
 
+// Wait for the writes in reqs[0..n) to finish, then clear the dirty
+// bits of the blocks they wrote.
+static void
+bc_writeback_wait(struct ide_req *reqs, uint32_t n)
+{
+	struct ide_req *req;
+	char *va;
+	int r;
+
+	for (req = reqs; req < reqs + n; req++) {
+		ide_wait(req);
+		if (req->ir_result < 0)
+			panic("Error - failed to flush block to disk %e", req->ir_result);
+		fs_stats.bc_writebacks += req->ir_nsecs / BLKSECTS;
+		for (va = req->ir_va; va < (char *) req->ir_va + req->ir_nsecs * SECTSIZE;
+		     va += BLKSIZE) {
+			bc_undirty(((uint32_t) va - DISKMAP) / BLKSIZE);
+			if ((r = sys_page_map(0, va, 0, va, uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+				panic("Error - failed to clear the dirty bit after flushing to disk %e", r);
+		}
+	}
+}
+
+// Write back the dirty blocks among the n in blocknos, which is
+// reordered.  The dirty blocks are sorted, and each run of adjacent
+// ones (up to WB_MAXBLOCKS) goes out as a single disk command.  The
+// commands are queued in block order, so the disk sweeps across them
+// once.  Blocks in the running journal transaction are left for the
+// commit to write.
+void
+bc_writeback(uint32_t *blocknos, uint32_t n)
+{
+	static struct ide_req reqs[WB_NREQ];
+	struct ide_req *req;
+	uint32_t i, j, ndirty, nreqs, bno;
+
+	// Keep the dirty blocks, in order
+	for (i = ndirty = 0; i < n; i++) {
+		bno = blocknos[i];
+		if (!va_is_mapped(BLOCKVA(bno)) || !va_is_dirty(BLOCKVA(bno))
+		    || journal_pending(bno))
+			continue;
+		for (j = ndirty++; j > 0 && blocknos[j - 1] > bno; j--)
+			blocknos[j] = blocknos[j - 1];
+		blocknos[j] = bno;
+	}
+
+	for (i = nreqs = 0; i < ndirty; i = j) {
+		for (j = i + 1; j < ndirty && j - i < WB_MAXBLOCKS
+			     && blocknos[j] == blocknos[j - 1] + 1; j++)
+			/* do nothing */;
+
+		req = &reqs[nreqs++];
+		memset(req, 0, sizeof(*req));
+		req->ir_secno = BLKSECTS * blocknos[i];
+		req->ir_nsecs = BLKSECTS * (j - i);
+		req->ir_va = BLOCKVA(blocknos[i]);
+		req->ir_write = 1;
+		ide_submit(req);
+
+		if (nreqs == WB_NREQ) {
+			bc_writeback_wait(reqs, nreqs);
+			nreqs = 0;
+		}
+	}
+	bc_writeback_wait(reqs, nreqs);
+}
+
+// Write back every block in the dirty set.
+void
+bc_sync(void)
+{
+	uint32_t i, n;
+
+	bc_dirty_compact();
+	for (i = 0; i < bc_ndirty; i++)
+		bc_undirty(bc_dirtylist[i]);
+	n = bc_ndirty;
+	bc_ndirty = 0;
+	bc_writeback(bc_dirtylist, n);
+	fs_stats.bc_dirty = bc_ndirtyset;
+}
+
+// Write back dirty blocks in the background.  On a timer tick, write
+// back the blocks that have been dirty for longer than the maximum age.
+// At any time, if more than BC_DIRTYHIGH blocks are dirty, write back
+// the oldest ones until BC_DIRTYLOW are left.
+void
+bc_flusher(bool tick)
+{
+	static uint32_t blocknos[BC_MAXBLOCKS + BC_MAXPINNED];
+	uint32_t i, n, nold;
+
+	if (tick)
+		bc_clock = sys_time_msec();
+	else if (bc_ndirtyset <= BC_DIRTYHIGH)
+		return;
+	if (bc_ndirtyset == 0)
+		return;
+
+	bc_dirty_compact();
+	nold = bc_ndirty > BC_DIRTYHIGH ? bc_ndirty - BC_DIRTYLOW : 0;
+	for (n = 0; n < bc_ndirty; n++)
+		if (n >= nold && bc_clock - bc_dirtytime[n] < bc_maxage)
+			break;
+	if (n == 0)
+		return;
+
+	for (i = 0; i < n; i++) {
+		blocknos[i] = bc_dirtylist[i];
+		bc_undirty(blocknos[i]);
+	}
+	bc_writeback(blocknos, n);
+	fs_stats.bc_flushes++;
+	fs_stats.bc_dirty = bc_ndirtyset;
+}
+
 // Test that the block cache works, by smashing the superblock and
 // reading it back.
 static void
@@ -164,6 +693,9 @@ void
 bc_init(void)
 {
 	struct Super super;
+
+	fs_stats.bc_limit = bc_limit;
+	bc_clock = sys_time_msec();
 	set_pgfault_handler(bc_pgfault);
 	check_bc();
 
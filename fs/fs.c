@@ -46,36 +46,75 @@ free_block(uint32_t blockno)
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		panic("attempt to free zero block");
+	if (blockno >= TMPFS_BLK0) {
+		tmpfs_free_block(blockno);
+		return;
+	}
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	journal_dirty(&bitmap[blockno/32]);
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// Where the next search for a free block starts when the caller has
+// no better idea: just past the block allocated last.
+static uint32_t alloc_cursor;
+
+// Search the bitmap for a free block, starting at block goal and
+// wrapping around, and allocate it.  Callers pass the block after the
+// one they used last, so files that grow sequentially stay contiguous
+// on disk.  The search skips a whole word of the bitmap at a time when
+// all 32 of its blocks are in use.
+//
+// The changed bitmap block is marked dirty rather than flushed, so
+// the flusher writes it back once for a batch of allocations.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
-//
-// Hint: use free_block as an example for manipulating the bitmap.
 int
-alloc_block(void)
+alloc_block_near(uint32_t goal)
 {
-	// The bitmap consists of one or more blocks.  A single bitmap block
-	// contains the in-use bits for BLKBITSIZE blocks.  There are
-	// super->s_nblocks blocks in the disk altogether.
-
-	uint32_t i = 0;
-
-	for (i = 1; i < super->s_nblocks; i++)
-	{
-		if (block_is_free(i))
-		{
-			bitmap[i/32] ^= 1 << (i%32);
-			flush_block(diskaddr(i));
-			return i;
+	uint32_t i, w, bits, nwords, blockno;
+
+	if (goal == 0 || goal >= super->s_nblocks)
+		goal = 1;
+
+	// Bits of goal's own word from goal on, then whole words, then
+	// the rest of goal's word again
+	nwords = (super->s_nblocks + 31) / 32;
+	w = goal / 32;
+	bits = bitmap[w] & ~((1 << (goal % 32)) - 1);
+	for (i = 0; i <= nwords; i++) {
+		for (; bits; bits &= bits - 1) {
+			blockno = w * 32 + __builtin_ctz(bits);
+			if (blockno != 0 && blockno < super->s_nblocks)
+				goto found;
 		}
+		w = (w + 1) % nwords;
+		bits = bitmap[w];
 	}
 	return -E_NO_DISK;
+
+found:
+	bitmap[blockno/32] &= ~(1 << (blockno%32));
+	journal_dirty(&bitmap[blockno/32]);
+	alloc_cursor = blockno + 1;
+	return blockno;
+}
+
+// Allocate a free block wherever the last allocation left off.
+int
+alloc_block(void)
+{
+	return alloc_block_near(alloc_cursor);
+}
+
+// Allocate a block for f, near block goal if it is on disk, or
+// anywhere at all if goal is 0.  A file in the tmpfs gets a tmpfs block.
+static int
+file_alloc_near(struct File *f, uint32_t goal)
+{
+	if (tmpfs_owns(f))
+		return tmpfs_alloc_block();
+	return goal ? alloc_block_near(goal) : alloc_block();
 }
 
 // Validate the file system bitmap.
@@ -115,16 +154,21 @@ fs_init(void)
 		ide_set_disk(1);
 	else
 		ide_set_disk(0);
+	ide_dma_init();
 	bc_init();
 
 	// Set "super" to point to the super block.
 	super = diskaddr(1);
 	check_super();
 
+	// Finish any transaction a crash left in the journal
+	journal_init();
+
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
 	check_bitmap();
-	
+
+	tmpfs_init();
 }
 
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
@@ -163,12 +207,15 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 		if (!alloc)
 			return -E_NOT_FOUND;
 
-		blockno = alloc_block();
+		blockno = file_alloc_near(f, f->f_direct[NDIRECT - 1] ?
+					  f->f_direct[NDIRECT - 1] + 1 : 0);
 		if (blockno < 0)
 			return -E_NO_DISK;
 
 		f->f_indirect = blockno;
 		memset(diskaddr(f->f_indirect), 0, BLKSIZE);
+		journal_dirty(f);
+		journal_dirty(diskaddr(f->f_indirect));
 	}
 
 	blk = (uint32_t *)diskaddr(f->f_indirect);
@@ -177,6 +224,318 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 	return 0;
 }
 
+// --------------------------------------------------------------
+// Extents
+// --------------------------------------------------------------
+
+// The extents of a File with FFLAG_EXTENTS that may hold a given file
+// block: the File's own, or those of one of its extent blocks.
+struct extlist {
+	struct Extent *el_ext;
+	uint32_t el_n;
+	uint32_t el_cap;
+	struct ExtentBlock *el_blk;	// Extent block, or NULL
+	int el_index;			// Its index entry in the File
+};
+
+// Return the index of the last of the n extents (or index entries) in
+// ext with e_fbno <= filebno, or -1 if there is none.
+static int
+extent_find(struct Extent *ext, uint32_t n, uint32_t filebno)
+{
+	int lo = 0, hi = n - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (ext[mid].e_fbno <= filebno)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return hi;
+}
+
+// Load the extents of f that cover (or would cover) block filebno.
+static void
+extlist_get(struct File *f, uint32_t filebno, struct extlist *el)
+{
+	if (f->f_depth == 0) {
+		el->el_ext = f->f_extent;
+		el->el_n = f->f_nextent;
+		el->el_cap = NFILEEXTENT;
+		el->el_blk = NULL;
+		el->el_index = -1;
+	} else {
+		el->el_index = MAX(extent_find(f->f_extent, f->f_nextent, filebno), 0);
+		el->el_blk = diskaddr(f->f_extent[el->el_index].e_start);
+		el->el_ext = el->el_blk->eb_extent;
+		el->el_n = el->el_blk->eb_nextent;
+		el->el_cap = NBLKEXTENT;
+	}
+}
+
+// Store back the extent count of el and mark it dirty.
+static void
+extlist_put(struct File *f, struct extlist *el)
+{
+	if (el->el_blk) {
+		el->el_blk->eb_nextent = el->el_n;
+		journal_dirty(el->el_blk);
+	} else {
+		f->f_nextent = el->el_n;
+		journal_dirty(f);
+	}
+}
+
+// Find block filebno of extent file f.  Set *pdiskbno to its disk
+// block, or 0 if it is not allocated, and *prun (if prun is not NULL)
+// to the number of blocks from filebno on that are in the same state
+// and, if allocated, contiguous on disk.
+static void
+file_extent_map(struct File *f, uint32_t filebno, uint32_t *pdiskbno, uint32_t *prun)
+{
+	struct extlist el;
+	struct Extent *e;
+	uint32_t run;
+	int i;
+
+	extlist_get(f, filebno, &el);
+	i = extent_find(el.el_ext, el.el_n, filebno);
+	if (i >= 0 && filebno < el.el_ext[i].e_fbno + el.el_ext[i].e_len) {
+		e = &el.el_ext[i];
+		*pdiskbno = e->e_start + (filebno - e->e_fbno);
+		run = e->e_fbno + e->e_len - filebno;
+	} else {
+		*pdiskbno = 0;
+		if (i + 1 < el.el_n)
+			run = el.el_ext[i + 1].e_fbno - filebno;
+		else if (el.el_blk && el.el_index + 1 < f->f_nextent)
+			run = f->f_extent[el.el_index + 1].e_fbno - filebno;
+		else
+			run = ~0;
+	}
+	if (prun)
+		*prun = run;
+}
+
+// Make room for another extent where block filebno of f goes, by
+// moving the File's extents out to an extent block, or by splitting
+// the full extent block in two.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_DISK if the disk is full, or the File's index is.
+static int
+file_extent_grow(struct File *f, uint32_t filebno)
+{
+	struct extlist el;
+	struct ExtentBlock *eb;
+	int r, half;
+
+	extlist_get(f, filebno, &el);
+	if (el.el_blk && f->f_nextent == NFILEEXTENT)
+		return -E_NO_DISK;
+	if ((r = file_alloc_near(f, 0)) < 0)
+		return r;
+	eb = diskaddr(r);
+	memset(eb, 0, BLKSIZE);
+
+	if (!el.el_blk) {
+		// Move the File's extents into the block
+		memmove(eb->eb_extent, f->f_extent, el.el_n * sizeof(struct Extent));
+		eb->eb_nextent = el.el_n;
+		f->f_depth = 1;
+		f->f_nextent = 1;
+		f->f_extent[0].e_fbno = 0;
+		f->f_extent[0].e_start = r;
+		f->f_extent[0].e_len = 0;
+	} else {
+		// Move the upper half of the full block into the new one
+		half = el.el_n / 2;
+		memmove(eb->eb_extent, &el.el_ext[half],
+			(el.el_n - half) * sizeof(struct Extent));
+		eb->eb_nextent = el.el_n - half;
+		el.el_n = half;
+		extlist_put(f, &el);
+
+		memmove(&f->f_extent[el.el_index + 2], &f->f_extent[el.el_index + 1],
+			(f->f_nextent - el.el_index - 1) * sizeof(struct Extent));
+		f->f_extent[el.el_index + 1].e_fbno = eb->eb_extent[0].e_fbno;
+		f->f_extent[el.el_index + 1].e_start = r;
+		f->f_extent[el.el_index + 1].e_len = 0;
+		f->f_nextent++;
+	}
+	journal_dirty(eb);
+	journal_dirty(f);
+	return 0;
+}
+
+// Record that block filebno of extent file f, which was not allocated,
+// is now kept in disk block diskbno.  The block joins the extent before
+// or after it when it is adjacent on disk.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_DISK if a new extent was needed but there was no room for it.
+static int
+file_extent_insert(struct File *f, uint32_t filebno, uint32_t diskbno)
+{
+	struct extlist el;
+	struct Extent *prev, *next;
+	int i, r;
+
+	while (1) {
+		extlist_get(f, filebno, &el);
+		i = extent_find(el.el_ext, el.el_n, filebno);
+		prev = i >= 0 ? &el.el_ext[i] : NULL;
+		next = i + 1 < el.el_n ? &el.el_ext[i + 1] : NULL;
+
+		if (prev && prev->e_fbno + prev->e_len == filebno
+		    && prev->e_start + prev->e_len == diskbno) {
+			prev->e_len++;
+			if (next && next->e_fbno == filebno + 1
+			    && next->e_start == diskbno + 1) {
+				prev->e_len += next->e_len;
+				memmove(next, next + 1,
+					(el.el_n - i - 2) * sizeof(struct Extent));
+				el.el_n--;
+			}
+			extlist_put(f, &el);
+			return 0;
+		}
+		if (next && next->e_fbno == filebno + 1 && next->e_start == diskbno + 1) {
+			next->e_fbno--;
+			next->e_start--;
+			next->e_len++;
+			extlist_put(f, &el);
+			return 0;
+		}
+		if (el.el_n < el.el_cap)
+			break;
+		if ((r = file_extent_grow(f, filebno)) < 0)
+			return r;
+	}
+
+	memmove(&el.el_ext[i + 2], &el.el_ext[i + 1],
+		(el.el_n - i - 1) * sizeof(struct Extent));
+	el.el_ext[i + 1].e_fbno = filebno;
+	el.el_ext[i + 1].e_start = diskbno;
+	el.el_ext[i + 1].e_len = 1;
+	el.el_n++;
+	extlist_put(f, &el);
+	return 0;
+}
+
+// Free the blocks of the n extents in ext from file block nblocks on,
+// and return how many extents are left.
+static uint32_t
+extents_truncate(struct Extent *ext, uint32_t n, uint32_t nblocks)
+{
+	struct Extent *e;
+	uint32_t keep, i;
+
+	while (n > 0) {
+		e = &ext[n - 1];
+		if (e->e_fbno + e->e_len <= nblocks)
+			break;
+		keep = e->e_fbno < nblocks ? nblocks - e->e_fbno : 0;
+		for (i = keep; i < e->e_len; i++)
+			free_block(e->e_start + i);
+		if (keep) {
+			e->e_len = keep;
+			break;
+		}
+		n--;
+	}
+	return n;
+}
+
+// Free the blocks of extent file f from file block nblocks on, along
+// with extent blocks that are no longer needed.
+static void
+file_extent_truncate(struct File *f, uint32_t nblocks)
+{
+	struct ExtentBlock *eb;
+	int i;
+
+	if (f->f_depth == 0) {
+		f->f_nextent = extents_truncate(f->f_extent, f->f_nextent, nblocks);
+		journal_dirty(f);
+		return;
+	}
+
+	for (i = f->f_nextent - 1; i >= 0; i--) {
+		eb = diskaddr(f->f_extent[i].e_start);
+		eb->eb_nextent = extents_truncate(eb->eb_extent, eb->eb_nextent, nblocks);
+		journal_dirty(eb);
+		if (eb->eb_nextent > 0 || i == 0)
+			break;
+		free_block(f->f_extent[i].e_start);
+		f->f_nextent = i;
+	}
+
+	// Move the extents back into the File if they fit
+	eb = diskaddr(f->f_extent[0].e_start);
+	if (f->f_nextent == 1 && eb->eb_nextent <= NFILEEXTENT) {
+		free_block(f->f_extent[0].e_start);
+		f->f_depth = 0;
+		f->f_nextent = eb->eb_nextent;
+		memmove(f->f_extent, eb->eb_extent, eb->eb_nextent * sizeof(struct Extent));
+	}
+	journal_dirty(f);
+}
+
+// Find block filebno of f, in either layout.  Set *pdiskbno to its disk
+// block, or 0 if it is not allocated.  If prun is not NULL, set *prun
+// to the number of blocks from filebno on that are known to be in the
+// same state and, if allocated, contiguous on disk (at least 1).
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if filebno is out of range.
+int
+file_map_block(struct File *f, uint32_t filebno, uint32_t *pdiskbno, uint32_t *prun)
+{
+	uint32_t *pdiskbno_slot;
+	int r;
+
+	if (f->f_flags & FFLAG_EXTENTS) {
+		if (filebno >= MAXFILESIZE / BLKSIZE)
+			return -E_INVAL;
+		file_extent_map(f, filebno, pdiskbno, prun);
+		return 0;
+	}
+
+	if ((r = file_block_walk(f, filebno, &pdiskbno_slot, 0)) == -E_NOT_FOUND)
+		*pdiskbno = 0;
+	else if (r < 0)
+		return r;
+	else
+		*pdiskbno = *pdiskbno_slot;
+	if (prun)
+		*prun = 1;
+	return 0;
+}
+
+// Allocate a block for block filebno of f, right after the file's
+// previous block if possible.
+static int
+file_block_alloc(struct File *f, uint32_t filebno)
+{
+	uint32_t prev;
+
+	if (filebno > 0 && file_map_block(f, filebno - 1, &prev, NULL) == 0
+	    && prev != 0)
+		return file_alloc_near(f, prev + 1);
+	return file_alloc_near(f, 0);
+}
+
+// Count a file block found already in the block cache.  Blocks that
+// are not are counted as misses when they are read in.
+static void
+file_block_hit(char *blk)
+{
+	if (!tmpfs_owns(blk) && va_is_mapped(blk))
+		fs_stats.bc_hits++;
+}
+
 // Set *blk to the address in memory where the filebno'th
 // block of file 'f' would be mapped.
 //
@@ -184,13 +543,31 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 //	-E_NO_DISK if a block needed to be allocated but the disk is full.
 //	-E_INVAL if filebno is out of range.
 //
-// Hint: Use file_block_walk and alloc_block.
+// Hint: Use file_block_walk and alloc_block_near.
+// Files with FFLAG_EXTENTS go through their extents instead.
 int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
 	int r = 0;
 	int blockno = 0;
-	uint32_t *disk_block_ptr = NULL;
+	uint32_t *disk_block_ptr = NULL, diskbno;
+
+	if (f->f_flags & FFLAG_EXTENTS) {
+		if ((r = file_map_block(f, filebno, &diskbno, NULL)) < 0)
+			return r;
+		if (diskbno == 0) {
+			if ((blockno = file_block_alloc(f, filebno)) < 0)
+				return -E_NO_DISK;
+			if ((r = file_extent_insert(f, filebno, blockno)) < 0) {
+				free_block(blockno);
+				return r;
+			}
+			diskbno = blockno;
+		}
+		*blk = (char *)diskaddr(diskbno);
+		file_block_hit(*blk);
+		return 0;
+	}
 
 	if (filebno > NDIRECT + NINDIRECT)
 		return -E_INVAL;
@@ -200,20 +577,153 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
 
 	if (*disk_block_ptr == 0)
 	{
-		// One of the direct blocks mapped to is not allocated
-		blockno = alloc_block();
+		// One of the direct blocks mapped to is not allocated.
+		// Try to put it right after the file's previous block.
+		blockno = file_block_alloc(f, filebno);
 		if (blockno < 0)
 			return -E_NO_DISK;
 
 		*disk_block_ptr = blockno;
+		journal_dirty(disk_block_ptr);
 	}
 
 	*blk = (char *)diskaddr(*disk_block_ptr);
+	file_block_hit(*blk);
+
+	return 0;
+}
+
+// --------------------------------------------------------------
+// Directory indexes
+// --------------------------------------------------------------
+
+// Return a pointer to slot k of index di.
+static uint32_t *
+dir_index_slot(struct DirIndex *di, uint32_t k)
+{
+	return (uint32_t *) diskaddr(di->di_blocks[k / DIRSLOTS]) + k % DIRSLOTS;
+}
+
+// Return directory entry number ent of dir, or NULL if there is none.
+static struct File *
+dir_entry(struct File *dir, uint32_t ent)
+{
+	char *blk;
+
+	if (ent >= dir->f_size / sizeof(struct File)
+	    || file_get_block(dir, ent / BLKFILES, &blk) < 0)
+		return NULL;
+	return (struct File *) blk + ent % BLKFILES;
+}
+
+// Free dir's index, so that it is searched linearly again.
+static void
+dir_index_drop(struct File *dir)
+{
+	struct DirIndex *di;
+	uint32_t i;
+
+	if (!(dir->f_flags & FFLAG_DIRINDEX))
+		return;
+	di = diskaddr(dir->f_dirindex);
+	for (i = 0; i < di->di_nslots / DIRSLOTS; i++)
+		free_block(di->di_blocks[i]);
+	free_block(dir->f_dirindex);
+	dir->f_flags &= ~FFLAG_DIRINDEX;
+	dir->f_dirindex = 0;
+	journal_dirty(dir);
+}
+
+// Put entry ent, named name, into index di, which has a free slot.
+static void
+dir_index_put(struct DirIndex *di, const char *name, uint32_t ent)
+{
+	uint32_t h = dirhash(name), mask = di->di_nslots - 1, k, *slot;
+
+	for (k = h & mask; *(slot = dir_index_slot(di, k)) != 0; k = (k + 1) & mask)
+		/* do nothing */;
+	*slot = DIRSLOT(h, ent);
+	journal_dirty(slot);
+	di->di_nentries++;
+	journal_dirty(di);
+}
+
+// Build a new index for dir, replacing any old one, with at least four
+// slots for every entry the directory has room for.
+//
+// Returns 0 on success, < 0 on error, in which case dir is left to be
+// searched linearly.  Errors are:
+//	-E_NO_DISK if the disk is full, or the directory too large.
+static int
+dir_index_build(struct File *dir)
+{
+	struct DirIndex *di;
+	struct File *f;
+	uint32_t i, nent, nslots;
+	int r, root;
+
+	dir_index_drop(dir);
+	nent = dir->f_size / sizeof(struct File);
+	for (nslots = DIRSLOTS; nslots < 4 * nent; nslots *= 2)
+		/* do nothing */;
+	if (nent >= (1 << DIRENTBITS) - 1
+	    || nslots / DIRSLOTS > MIN(DIRINDEX_MAXBLOCKS, ARRAY_SIZE(di->di_blocks)))
+		return -E_NO_DISK;
+
+	if ((root = file_alloc_near(dir, 0)) < 0)
+		return root;
+	di = diskaddr(root);
+	memset(di, 0, BLKSIZE);
+	for (i = 0; i < nslots / DIRSLOTS; i++) {
+		if ((r = file_alloc_near(dir, 0)) < 0) {
+			while (i-- > 0)
+				free_block(di->di_blocks[i]);
+			free_block(root);
+			return r;
+		}
+		di->di_blocks[i] = r;
+		memset(diskaddr(r), 0, BLKSIZE);
+		journal_dirty(diskaddr(r));
+	}
+	di->di_nslots = nslots;
+
+	for (i = 0; i < nent; i++)
+		if ((f = dir_entry(dir, i)) && f->f_name[0] != '\0')
+			dir_index_put(di, f->f_name, i);
+	journal_dirty(di);
 
+	dir->f_dirindex = root;
+	dir->f_flags |= FFLAG_DIRINDEX;
+	journal_dirty(dir);
 	return 0;
 }
 
+// Add entry ent of dir, which has just been named name, to dir's index.
+// The index is rebuilt twice as large when it gets half full, and a
+// linear directory gets one once it grows past DIRINDEX_MINBLOCKS
+// blocks.  If there is no room for an index, the directory is left
+// to be searched linearly.
+static void
+dir_index_add(struct File *dir, const char *name, uint32_t ent)
+{
+	struct DirIndex *di;
+
+	if (!(dir->f_flags & FFLAG_DIRINDEX)) {
+		if ((super->s_features & FS_FEAT_DIRINDEX)
+		    && dir->f_size / BLKSIZE > DIRINDEX_MINBLOCKS)
+			dir_index_build(dir);
+		return;
+	}
+
+	di = diskaddr(dir->f_dirindex);
+	if (2 * (di->di_nentries + 1) > di->di_nslots)
+		dir_index_build(dir);
+	else
+		dir_index_put(di, name, ent);
+}
+
 // Try to find a file named "name" in dir.  If so, set *file to it.
+// An indexed directory is searched through its hash index.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
 //	-E_NOT_FOUND if the file is not found
@@ -221,10 +731,25 @@ static int
 dir_lookup(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t i, j, nblock;
+	uint32_t i, j, nblock, h, mask, slot;
+	struct DirIndex *di;
 	char *blk;
 	struct File *f;
 
+	if (dir->f_flags & FFLAG_DIRINDEX) {
+		di = diskaddr(dir->f_dirindex);
+		h = dirhash(name);
+		mask = di->di_nslots - 1;
+		for (i = h & mask; (slot = *dir_index_slot(di, i)) != 0; i = (i + 1) & mask)
+			if (DIRSLOT_TAG(slot) == h >> DIRENTBITS
+			    && (f = dir_entry(dir, DIRSLOT_ENT(slot)))
+			    && strcmp(f->f_name, name) == 0) {
+				*file = f;
+				return 0;
+			}
+		return -E_NOT_FOUND;
+	}
+
 	// Search dir for name.
 	// We maintain the invariant that the size of a directory-file
 	// is always a multiple of the file system's block size.
@@ -243,10 +768,29 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Find the first file in dir at entry number *pent or after it.
+// Set *file to it and *pent to its entry number.
+//
+// Returns 0 on success, -E_NOT_FOUND past the last file.
+int
+dir_read(struct File *dir, uint32_t *pent, struct File **file)
+{
+	struct File *f;
+
+	for (; (f = dir_entry(dir, *pent)); (*pent)++)
+		if (f->f_name[0] != '\0') {
+			*file = f;
+			return 0;
+		}
+	return -E_NOT_FOUND;
+}
+
+// Set *file to point at a free File structure in dir, and *pent to
+// its entry number.  The caller is responsible for filling in the File
+// fields.  Only the last block of an indexed directory is searched,
+// since entries are never freed in the middle.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, struct File **file, uint32_t *pent)
 {
 	int r;
 	uint32_t nblock, i, j;
@@ -255,21 +799,27 @@ dir_alloc_file(struct File *dir, struct File **file)
 
 	assert((dir->f_size % BLKSIZE) == 0);
 	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
+	i = (dir->f_flags & FFLAG_DIRINDEX) && nblock > 0 ? nblock - 1 : 0;
+	for (; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
 			return r;
 		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
 			if (f[j].f_name[0] == '\0') {
 				*file = &f[j];
+				*pent = i * BLKFILES + j;
 				return 0;
 			}
 	}
 	dir->f_size += BLKSIZE;
+	journal_dirty(dir);
 	if ((r = file_get_block(dir, i, &blk)) < 0)
 		return r;
+	memset(blk, 0, BLKSIZE);
+	journal_dirty(blk);
 	f = (struct File*) blk;
 	*file = &f[0];
+	*pent = i * BLKFILES;
 	return 0;
 }
 
@@ -282,18 +832,79 @@ skip_slash(const char *p)
 	return p;
 }
 
+// --------------------------------------------------------------
+// Path lookup cache
+// --------------------------------------------------------------
+
+// Recent results of looking up a name in a directory, in a direct-
+// mapped table hashed on both.  dc_file is NULL for a name that was not
+// found.  Since File structures never move, an entry stays right until
+// the name is created in (or removed from) its directory.
+struct dcache_ent {
+	struct File *dc_dir;		// Directory, or NULL if unused
+	struct File *dc_file;		// What name was found to be
+	char dc_name[MAXNAMELEN];
+};
+static struct dcache_ent dcache[DCACHE_SIZE];
+
+static struct dcache_ent *
+dcache_slot(struct File *dir, const char *name)
+{
+	return &dcache[(dirhash(name) ^ ((uint32_t) dir / sizeof(struct File)))
+		       % DCACHE_SIZE];
+}
+
+// Look up name in dir in the cache.  Returns 1 and sets *file (to NULL
+// if name is known not to exist) on a hit, 0 on a miss.
+static int
+dcache_lookup(struct File *dir, const char *name, struct File **file)
+{
+	struct dcache_ent *dc = dcache_slot(dir, name);
+
+	if (dc->dc_dir != dir || strcmp(dc->dc_name, name) != 0) {
+		fs_stats.dc_misses++;
+		return 0;
+	}
+	fs_stats.dc_hits++;
+	*file = dc->dc_file;
+	return 1;
+}
+
+// Remember that name in dir is file (NULL if it does not exist).
+static void
+dcache_enter(struct File *dir, const char *name, struct File *file)
+{
+	struct dcache_ent *dc = dcache_slot(dir, name);
+
+	dc->dc_dir = dir;
+	dc->dc_file = file;
+	strcpy(dc->dc_name, name);
+}
+
+// Forget what is known about name in dir.
+static void
+dcache_invalidate(struct File *dir, const char *name)
+{
+	struct dcache_ent *dc = dcache_slot(dir, name);
+
+	if (dc->dc_dir == dir && strcmp(dc->dc_name, name) == 0)
+		dc->dc_dir = NULL;
+}
+
 // Evaluate a path name, starting at the root.
 // On success, set *pf to the file we found
 // and set *pdir to the directory the file is in.
 // If we cannot find the file but find the directory
 // it should be in, set *pdir and copy the final path
-// element into lastelem.
+// element into lastelem.  *pdir is then left locked, so that the
+// caller can create the file before anyone else does.
 static int
 walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem)
 {
 	const char *p;
 	char name[MAXNAMELEN];
 	struct File *dir, *f;
+	bool keep;
 	int r;
 
 	// if (*path != '/')
@@ -320,7 +931,29 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		if (dir->f_type != FTYPE_DIR)
 			return -E_NOT_FOUND;
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
+		// A create keeps the directory locked from the lookup that
+		// finds the name missing until the file is in it
+		keep = lastelem && *path == '\0';
+		if (keep)
+			file_lock(dir);
+		if (dir == &super->s_root && strcmp(name, TMPFS_NAME) == 0) {
+			// The tmpfs is mounted over whatever the disk has here
+			f = tmpfs_root;
+			r = 0;
+		} else if (dcache_lookup(dir, name, &f))
+			r = f ? 0 : -E_NOT_FOUND;
+		else {
+			if (!keep)
+				file_lock(dir);
+			if ((r = dir_lookup(dir, name, &f)) == 0 || r == -E_NOT_FOUND)
+				dcache_enter(dir, name, r == 0 ? f : NULL);
+			if (!keep)
+				file_unlock(dir);
+		}
+		if (keep && r != -E_NOT_FOUND)
+			file_unlock(dir);
+
+		if (r < 0) {
 			if (r == -E_NOT_FOUND && *path == '\0') {
 				if (pdir)
 					*pdir = dir;
@@ -342,25 +975,40 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 // File operations
 // --------------------------------------------------------------
 
-// Create "path".  On success set *pf to point at the file and return 0.
+// Create "path".  On success set *pf to point at the file, and *pdir
+// if it is not NULL to point at its directory, and return 0.
 // On error return < 0.
 int
-file_create(const char *path, struct File **pf)
+file_create(const char *path, struct File **pf, struct File **pdir)
 {
 	char name[MAXNAMELEN];
 	int r;
+	uint32_t ent;
 	struct File *dir, *f;
 
 	if ((r = walk_path(path, &dir, &f, name)) == 0)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
+	if ((r = dir_alloc_file(dir, &f, &ent)) < 0) {
+		file_unlock(dir);
 		return r;
+	}
 
+	memset(f, 0, sizeof(*f));
 	strcpy(f->f_name, name);
+	if ((super->s_features & FS_FEAT_EXTENTS) && !tmpfs_owns(f))
+		f->f_flags = FFLAG_EXTENTS;
+	journal_dirty(f);
+	dir_index_add(dir, f->f_name, ent);
+	dcache_invalidate(dir, name);
 	*pf = f;
-	file_flush(dir);
+	if (pdir)
+		*pdir = dir;
+	// With a journal, the new entry goes out with the next commit
+	if (!(super->s_features & FS_FEAT_JOURNAL))
+		file_flush(dir);
+	file_unlock(dir);
 	return 0;
 }
 
@@ -399,6 +1047,35 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	return count;
 }
 
+// Start bringing up to n blocks of f, starting at block filebno, into
+// the block cache.  Each run of blocks that are next to each other on
+// disk and not cached yet is read with a single disk command.
+void
+file_readahead(struct File *f, uint32_t filebno, uint32_t n)
+{
+	uint32_t diskbno, run = 0, runlen = 0;
+	uint32_t nblocks = ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE;
+
+	if (tmpfs_owns(f))
+		return;
+	for (n = MIN(n, RA_MAXBLOCKS); n > 0 && filebno < nblocks; n--, filebno++) {
+		if (file_map_block(f, filebno, &diskbno, NULL) < 0
+		    || diskbno == 0
+		    || block_is_cached(diskbno))
+			diskbno = 0;
+
+		if (runlen && diskbno == run + runlen) {
+			runlen++;
+			continue;
+		}
+		if (runlen)
+			bc_readahead(run, runlen);
+		run = diskbno;
+		runlen = diskbno ? 1 : 0;
+	}
+	if (runlen)
+		bc_readahead(run, runlen);
+}
 
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
@@ -421,6 +1098,7 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
 		memmove(blk + pos % BLKSIZE, buf, bn);
+		bc_dirty(blk);
 		pos += bn;
 		buf += bn;
 	}
@@ -441,6 +1119,7 @@ file_free_block(struct File *f, uint32_t filebno)
 	if (*ptr) {
 		free_block(*ptr);
 		*ptr = 0;
+		journal_dirty(ptr);
 	}
 	return 0;
 }
@@ -462,6 +1141,12 @@ file_truncate_blocks(struct File *f, off_t newsize)
 
 	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
+	if (f->f_flags & FFLAG_EXTENTS) {
+		if (new_nblocks < old_nblocks)
+			file_extent_truncate(f, new_nblocks);
+		return;
+	}
+
 	for (bno = new_nblocks; bno < old_nblocks; bno++)
 		if ((r = file_free_block(f, bno)) < 0)
 			cprintf("warning: file_free_block: %e", r);
@@ -469,6 +1154,7 @@ file_truncate_blocks(struct File *f, off_t newsize)
 	if (new_nblocks <= NDIRECT && f->f_indirect) {
 		free_block(f->f_indirect);
 		f->f_indirect = 0;
+		journal_dirty(f);
 	}
 }
 
@@ -479,29 +1165,59 @@ file_set_size(struct File *f, off_t newsize)
 	if (f->f_size > newsize)
 		file_truncate_blocks(f, newsize);
 	f->f_size = newsize;
-	flush_block(f);
+	journal_dirty(f);
+	if (!(super->s_features & FS_FEAT_JOURNAL))
+		flush_block(f);
 	return 0;
 }
 
+// Blocks file_flush has found to be dirty, and the lock on them
+static uint32_t flush_blocknos[BC_MAXBLOCKS + BC_MAXPINNED];
+static struct fslock flush_lock;
+
+// Add blockno to flush_blocknos if it is cached and dirty, writing
+// back the ones found so far if the array is full.
+static void
+file_flush_add(uint32_t blockno, uint32_t *pn)
+{
+	void *va = (void *) (DISKMAP + blockno * BLKSIZE);
+
+	if (!va_is_mapped(va) || !va_is_dirty(va))
+		return;
+	if (*pn == ARRAY_SIZE(flush_blocknos)) {
+		bc_writeback(flush_blocknos, *pn);
+		*pn = 0;
+	}
+	flush_blocknos[(*pn)++] = blockno;
+}
+
 // Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// Loop over all the blocks in file, a run of disk blocks at a time, and
+// let bc_writeback write out the dirty ones in a single sweep.
 void
 file_flush(struct File *f)
 {
-	int i;
-	uint32_t *pdiskbno;
-
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-		    pdiskbno == NULL || *pdiskbno == 0)
-			continue;
-		flush_block(diskaddr(*pdiskbno));
+	uint32_t i, j, n = 0, run, diskbno;
+	uint32_t nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+
+	if (tmpfs_owns(f))
+		return;
+	fslock_acquire(&flush_lock);
+	for (i = 0; i < nblocks; i += run) {
+		if (file_map_block(f, i, &diskbno, &run) < 0)
+			break;
+		run = MIN(run, nblocks - i);
+		for (j = 0; diskbno && j < run; j++)
+			file_flush_add(diskbno + j, &n);
 	}
-	flush_block(f);
-	if (f->f_indirect)
-		flush_block(diskaddr(f->f_indirect));
+	file_flush_add(((uint32_t) f - DISKMAP) / BLKSIZE, &n);
+	if (!(f->f_flags & FFLAG_EXTENTS) && f->f_indirect)
+		file_flush_add(f->f_indirect, &n);
+	if ((f->f_flags & FFLAG_EXTENTS) && f->f_depth)
+		for (i = 0; i < f->f_nextent; i++)
+			file_flush_add(f->f_extent[i].e_start, &n);
+	bc_writeback(flush_blocknos, n);
+	fslock_release(&flush_lock);
 }
 
 
@@ -509,8 +1225,7 @@ file_flush(struct File *f)
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	bc_sync();
+	journal_sync();
 }
 
@@ -11,12 +11,107 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Most blocks the block cache keeps in memory, besides the superblock
+ * and bitmap */
+#define BC_MAXBLOCKS	512
+
+/* Fewest it may be limited to.  A single instruction can touch two
+ * blocks, as a memmove from one file block to another does, and the
+ * blocks that lead to them -- a directory block, an indirect block --
+ * must stay in too, or the cache evicts what it is using and livelocks */
+#define BC_MINBLOCKS	8
+
+/* Most blocks that are always in memory: the boot block, superblock and
+ * the bitmap of the largest disk */
+#define BC_MAXPINNED	(2 + DISKSIZE / BLKSIZE / BLKBITSIZE)
+
+/* Read-ahead window for sequential access, in blocks.  The largest
+ * window is as much as one IDE command can transfer. */
+#define RA_MINBLOCKS	4
+#define RA_MAXBLOCKS	(256 / BLKSECTS)
+
+/* A linear directory gets a hash index once it grows past this many
+ * blocks, if the file system has FS_FEAT_DIRINDEX.  An index has at
+ * most DIRINDEX_MAXBLOCKS blocks of slots, so that building one fits
+ * in a request's share of a journal transaction. */
+#define DIRINDEX_MINBLOCKS	4
+#define DIRINDEX_MAXBLOCKS	8
+
+/* Entries in the path lookup cache */
+#define DCACHE_SIZE		256
+
+/* Writeback sends runs of up to WB_MAXBLOCKS adjacent dirty blocks to
+ * the disk as single commands, with up to WB_NREQ of them queued. */
+#define WB_MAXBLOCKS	(256 / BLKSECTS)
+#define WB_NREQ		32
+
+/* The flusher writes back blocks that have been dirty for FLUSH_MAXAGE
+ * msec, looking every FLUSH_INTERVAL msec, and writes back the oldest
+ * ones whenever more than BC_DIRTYHIGH blocks are dirty, until
+ * BC_DIRTYLOW are left. */
+#define FLUSH_INTERVAL	1000
+#define FLUSH_MAXAGE	5000
+#define BC_DIRTYHIGH	(BC_MAXBLOCKS / 4)
+#define BC_DIRTYLOW	(BC_DIRTYHIGH / 2)
+
+/* Blocks being read ahead are read into staging pages here, RA_MAXBLOCKS
+ * for each of the BC_NIO runs that can be in flight at once, and mapped
+ * at DISKMAP when they arrive. */
+#define BCSTAGE		0x0f000000
+#define BC_NIO		4
+
+/* Requests are served by NWORKERS threads, each with WORKER_STKPAGES
+ * of stack, in slots of WORKER_SLOT bytes from WORKERVA up. */
+#define NWORKERS	8
+#define WORKER_STKPAGES	4
+#define WORKER_SLOT	(256 * PGSIZE)
+#define WORKERVA	0x0e000000
+
+/* The tmpfs, mounted over /TMPFS_NAME, keeps up to TMPFS_MAXBLOCKS
+ * blocks of memory from TMPFSVA up, and by default at most
+ * TMPFS_DEFBLOCKS at once.  Its block numbers start at TMPFS_BLK0,
+ * past any disk block. */
+#define TMPFS_NAME	"tmp"
+#define TMPFSVA		0x0c000000
+#define TMPFS_MAXBLOCKS	4096
+#define TMPFS_DEFBLOCKS	1024
+#define TMPFS_BLK0	0x40000000
+
+/* Commits gather the journal header and the blocks of the transaction
+ * here.  A transaction takes new requests while it has room for
+ * JOURNAL_OPBLOCKS more blocks, plus every bitmap block, for each one
+ * in progress.  No request changes more metadata blocks than that. */
+#define JOURNALVA	0x0f400000
+#define JOURNAL_OPBLOCKS	16
+
+/* A lock a worker holds while it waits for the disk */
+struct fslock {
+	struct worker *l_owner;		// NULL if free
+};
+
 extern struct Super *super;		// superblock
 extern uint32_t *bitmap;		// bitmap blocks mapped in memory
+extern struct Fsstats fs_stats;		// counters for FSREQ_STATS
+extern struct File *tmpfs_root;		// root of the tmpfs
+
+/* An IDE transfer, queued with ide_submit */
+struct ide_req {
+	uint32_t ir_secno;		// first sector
+	size_t ir_nsecs;		// sectors, at most 256
+	void *ir_va;			// buffer
+	bool ir_write;			// memory to disk?
+	volatile bool ir_done;		// set when the transfer finishes
+	int ir_result;			// then 0, or < 0 on error
+	struct ide_req *ir_next;	// queue link
+};
 
 /* ide.c */
 bool	ide_probe_disk1(void);
 void	ide_set_disk(int diskno);
+void	ide_dma_init(void);
+void	ide_submit(struct ide_req *req);
+void	ide_wait(struct ide_req *req);
+void	ide_intr(void);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
@@ -26,23 +121,83 @@ void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	bc_dirty(void *addr);
+bool	block_is_dirty(uint32_t blockno);
+void	bc_writeback(uint32_t *blocknos, uint32_t n);
+void	bc_sync(void);
+void	bc_flusher(bool tick);
+void	bc_set_max_age(uint32_t msec);
+void	bc_set_limit(uint32_t nblocks);
+void	bc_readahead(uint32_t blockno, uint32_t n);
+void	bc_poll(void);
+bool	block_is_cached(uint32_t blockno);
+void	bc_fetch(uint32_t blockno);
 void	bc_init(void);
 
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
-int	file_create(const char *path, struct File **f);
+int	file_map_block(struct File *f, uint32_t filebno, uint32_t *pdiskbno, uint32_t *prun);
+int	file_create(const char *path, struct File **f, struct File **dir);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
+void	file_readahead(struct File *f, uint32_t filebno, uint32_t n);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
 int	file_remove(const char *path);
+int	dir_read(struct File *dir, uint32_t *pent, struct File **file);
 void	fs_sync(void);
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
+void	free_block(uint32_t blockno);
 int	alloc_block(void);
+int	alloc_block_near(uint32_t goal);
+
+/* serv.c */
+void	serve_request(envid_t whom, uint32_t req, union Fsipc *ipc, int perm,
+		      size_t npages);
+
+/* worker.c */
+void	worker_init(void);
+union Fsipc *worker_next(void);
+void	worker_start(union Fsipc *ipc, envid_t whom, uint32_t req, int perm,
+		     size_t npages);
+void	worker_run(void);
+bool	worker_self(void);
+void	worker_wait(void);
+void	worker_wakeup(void);
+void *	worker_scratch(void);
+void *	worker_reply(void);
+void	fslock_acquire(struct fslock *l);
+void	fslock_release(struct fslock *l);
+bool	fslock_held(struct fslock *l);
+void	file_lock(struct File *f);
+void	file_unlock(struct File *f);
+
+/* tmpfs.c */
+void	tmpfs_init(void);
+bool	tmpfs_owns(void *va);
+void *	tmpfs_addr(uint32_t blockno);
+int	tmpfs_alloc_block(void);
+void	tmpfs_free_block(uint32_t blockno);
+void	tmpfs_set_limit(uint32_t nblocks);
+
+/* journal.c */
+void	journal_init(void);
+int	journal_replay(void);
+void	journal_dirty(void *addr);
+bool	journal_pending(uint32_t blockno);
+void	journal_begin(void);
+void	journal_end(void);
+void	journal_commit(void);
+bool	journal_try_commit(void);
+void	journal_sync(void);
+void	journal_tick(void);
+
+/* timer.c */
+void	timer(envid_t fs_envid, uint32_t interval);
 
 /* test.c */
 void	fs_test(void);
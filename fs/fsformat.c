@@ -42,9 +42,11 @@ struct Dir
 };
 
 uint32_t nblocks;
+int blkptrs;		// write the old block-pointer layout instead of extents
 char *diskmap, *diskpos;
 struct Super *super;
 uint32_t *bitmap;
+struct JournalHeader *journal;
 
 void
 panic(const char *fmt, ...)
@@ -111,12 +113,20 @@ opendisk(const char *name)
 	super = alloc(BLKSIZE);
 	super->s_magic = FS_MAGIC;
 	super->s_nblocks = nblocks;
+	super->s_features = blkptrs ? 0 : FS_FEAT_EXTENTS | FS_FEAT_DIRINDEX;
 	super->s_root.f_type = FTYPE_DIR;
 	strcpy(super->s_root.f_name, "/");
 
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	// An empty journal, with room for a full transaction
+	journal = alloc((1 + JOURNAL_MAXBLOCKS) * BLKSIZE);
+	journal->jh_magic = JOURNAL_MAGIC;
+	super->s_journal = blockof(journal);
+	super->s_njournal = 1 + JOURNAL_MAXBLOCKS;
+	super->s_features |= FS_FEAT_JOURNAL;
 }
 
 void
@@ -137,6 +147,20 @@ finishfile(struct File *f, uint32_t start, uint32_t len)
 	int i;
 	f->f_size = len;
 	len = ROUNDUP(len, BLKSIZE);
+	if (!blkptrs) {
+		// The file's blocks are contiguous: one extent holds them all
+		f->f_flags = FFLAG_EXTENTS;
+		f->f_depth = 0;
+		f->f_nextent = 0;
+		if (len > 0) {
+			f->f_extent[0].e_fbno = 0;
+			f->f_extent[0].e_start = start;
+			f->f_extent[0].e_len = len / BLKSIZE;
+			f->f_nextent = 1;
+		}
+		return;
+	}
+	f->f_flags = 0;
 	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
 		f->f_direct[i] = start + i;
 	if (i == NDIRECT) {
@@ -161,11 +185,41 @@ diradd(struct Dir *d, uint32_t type, const char *name)
 	struct File *out = &d->ents[d->n++];
 	if (d->n > MAX_DIR_ENTS)
 		panic("too many directory entries");
+	memset(out, 0, sizeof *out);
 	strcpy(out->f_name, name);
 	out->f_type = type;
 	return out;
 }
 
+// Give directory d, whose entries start at ents, a hash index with at
+// least four slots for every entry its blocks have room for.
+void
+indexdir(struct Dir *d, struct File *ents)
+{
+	struct DirIndex *di = alloc(BLKSIZE);
+	uint32_t nslots, i, k, h, *slot;
+
+	for (nslots = DIRSLOTS; nslots < 4 * d->f->f_size / sizeof(struct File); nslots *= 2)
+		;
+	di->di_nslots = nslots;
+	for (i = 0; i < nslots / DIRSLOTS; i++)
+		di->di_blocks[i] = blockof(alloc(BLKSIZE));
+
+	for (i = 0; i < d->n; i++) {
+		h = dirhash(ents[i].f_name);
+		for (k = h & (nslots - 1); ; k = (k + 1) & (nslots - 1)) {
+			slot = (uint32_t *) (diskmap + di->di_blocks[k / DIRSLOTS] * BLKSIZE) + k % DIRSLOTS;
+			if (*slot == 0)
+				break;
+		}
+		*slot = DIRSLOT(h, i);
+		di->di_nentries++;
+	}
+
+	d->f->f_flags |= FFLAG_DIRINDEX;
+	d->f->f_dirindex = blockof(di);
+}
+
 void
 finishdir(struct Dir *d)
 {
@@ -173,6 +227,8 @@ finishdir(struct Dir *d)
 	struct File *start = alloc(size);
 	memmove(start, d->ents, size);
 	finishfile(d->f, blockof(start), ROUNDUP(size, BLKSIZE));
+	if (!blkptrs)
+		indexdir(d, start);
 	free(d->ents);
 	d->ents = NULL;
 }
@@ -192,7 +248,7 @@ writefile(struct Dir *dir, const char *name)
 		panic("stat %s: %s", name, strerror(errno));
 	if (!S_ISREG(st.st_mode))
 		panic("%s is not a regular file", name);
-	if (st.st_size >= MAXFILESIZE)
+	if (st.st_size >= (blkptrs ? MAXBLKPTRSIZE : MAXFILESIZE))
 		panic("%s too large", name);
 
 	last = strrchr(name, '/');
@@ -211,7 +267,8 @@ writefile(struct Dir *dir, const char *name)
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n");
+	fprintf(stderr, "Usage: fsformat [-p] fs.img NBLOCKS files...\n");
+	fprintf(stderr, "  -p  lay files out with block pointers, not extents\n");
 	exit(2);
 }
 
@@ -223,7 +280,13 @@ main(int argc, char **argv)
 	struct Dir root;
 
 	assert(BLKSIZE % sizeof(struct File) == 0);
+	assert(sizeof(struct File) == 256);
 
+	if (argc > 1 && strcmp(argv[1], "-p") == 0) {
+		blkptrs = 1;
+		argc--;
+		argv++;
+	}
 	if (argc < 3)
 		usage();
 
@@ -1,5 +1,18 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code.
+ *
+ * When the kernel found a bus-master IDE controller on the PCI bus,
+ * transfers are queued with ide_submit and done by DMA, one command at
+ * a time.  Each command takes the request at the head of the queue
+ * along with any queued requests for the sectors just before or after
+ * it.  The kernel passes on IRQ 14 when a command finishes, and the
+ * file system server calls ide_intr, which completes the command's
+ * requests and starts the next one.  ide_wait polls instead, so it can
+ * be used anywhere.
+ *
+ * Without a bus-master controller, requests are done by PIO as soon as
+ * they are submitted.
+ *
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -12,8 +25,46 @@
 #define IDE_DF		0x20
 #define IDE_ERR		0x01
 
+#define IDE_CMD_READ		0x20
+#define IDE_CMD_WRITE		0x30
+#define IDE_CMD_READ_DMA	0xC8
+#define IDE_CMD_WRITE_DMA	0xCA
+
+// Bus-master registers, relative to the base port
+#define BM_CMD		0
+#define BM_STATUS	2
+#define BM_PRDT		4	// physical address of the PRD table
+
+#define BM_CMD_START	0x01
+#define BM_CMD_READ	0x08	// transfer from the disk to memory
+#define BM_STATUS_ACTIVE	0x01
+#define BM_STATUS_ERR	0x02
+#define BM_STATUS_INTR	0x04
+
+// Physical region descriptor: one physically contiguous piece of
+// a DMA transfer, which must not cross a 64K boundary.
+struct ide_prd {
+	uint32_t prd_addr;
+	uint16_t prd_count;	// bytes
+	uint16_t prd_flags;
+};
+
+#define PRD_EOT		0x8000	// last entry of the table
+
+#define IDE_MAXSECS	256	// most sectors one command can move
+#define NPRD		(PGSIZE / sizeof(struct ide_prd))
+#define IDE_MAXMERGE	32	// most requests one command can serve
+
 static int diskno = 1;
 
+static struct ide_prd prdt[NPRD] __attribute__((aligned(PGSIZE)));
+static physaddr_t prdt_pa;
+static int bmbase;		// 0 if we are not using DMA
+
+static struct ide_req *ide_queue;		// not started, oldest first
+static struct ide_req *ide_active[IDE_MAXMERGE];	// in the command in flight,
+static int ide_nactive;				// in sector order
+
 static int
 ide_wait_ready(bool check_error)
 {
@@ -59,14 +110,30 @@ ide_set_disk(int d)
 	diskno = d;
 }
 
-
-int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+// Use bus-master DMA if the kernel found a controller that can do it.
+void
+ide_dma_init(void)
 {
-	int r;
+	int base, pa;
 
-	assert(nsecs <= 256);
+	if ((base = sys_ide_bmbase()) < 0)
+		return;
+	if ((pa = sys_page_phys(prdt)) < 0)
+		panic("ide_dma_init: sys_page_phys: %e", pa);
+	prdt_pa = pa;
+	bmbase = base;
+
+	// Without the interrupt, queued commands only start when
+	// someone waits
+	if (sys_irq_listen(IRQ_IDE) < 0)
+		cprintf("IDE: no completion interrupts\n");
+	cprintf("IDE: using bus-master DMA\n");
+}
 
+// Issue command cmd for nsecs sectors starting at secno.
+static void
+ide_command(uint32_t secno, size_t nsecs, uint8_t cmd)
+{
 	ide_wait_ready(0);
 
 	outb(0x1F2, nsecs);
@@ -74,39 +141,211 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 	outb(0x1F4, (secno >> 8) & 0xFF);
 	outb(0x1F5, (secno >> 16) & 0xFF);
 	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
+	outb(0x1F7, cmd);
+}
+
+// Do req by PIO, with the CPU moving every word.
+static int
+ide_pio(struct ide_req *req)
+{
+	uint32_t nsecs;
+	char *va = req->ir_va;
+	int r;
+
+	ide_command(req->ir_secno, req->ir_nsecs,
+		    req->ir_write ? IDE_CMD_WRITE : IDE_CMD_READ);
 
-	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
+	for (nsecs = req->ir_nsecs; nsecs > 0; nsecs--, va += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
 			return r;
-		insl(0x1F0, dst, SECTSIZE/4);
+		if (req->ir_write)
+			outsl(0x1F0, va, SECTSIZE/4);
+		else
+			insl(0x1F0, va, SECTSIZE/4);
 	}
 
 	return 0;
 }
 
-int
-ide_write(uint32_t secno, const void *src, size_t nsecs)
+// Fill in PRD entries for req's buffer starting at prdt[n], one per page
+// it touches.  Returns the next free entry, or < 0 if a page is not
+// mapped or the table is full.
+static int
+ide_prd_fill(struct ide_req *req, int n)
 {
-	int r;
+	char *va = req->ir_va;
+	size_t len, chunk;
+	int pa;
 
-	assert(nsecs <= 256);
+	for (len = req->ir_nsecs * SECTSIZE; len > 0; n++) {
+		if (n == NPRD)
+			return -E_INVAL;
+		if ((pa = sys_page_phys(va)) < 0)
+			return pa;
+		chunk = MIN(len, PGSIZE - PGOFF(va));
+		prdt[n].prd_addr = pa;
+		prdt[n].prd_count = chunk;
+		prdt[n].prd_flags = 0;
+		va += chunk;
+		len -= chunk;
+	}
+	return n;
+}
 
-	ide_wait_ready(0);
+// Mark the requests of the command in flight done with result r.
+static void
+ide_finish(int r)
+{
+	int i;
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x30);	// CMD 0x30 means write sector
+	for (i = 0; i < ide_nactive; i++) {
+		ide_active[i]->ir_result = r;
+		ide_active[i]->ir_done = 1;
+	}
+	ide_nactive = 0;
+}
 
-	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
-		if ((r = ide_wait_ready(1)) < 0)
-			return r;
-		outsl(0x1F0, src, SECTSIZE/4);
+// Take the request at the head of the queue, and any queued requests
+// for the sectors right before or after it in the same direction, and
+// start a DMA command for all of them.
+static void
+ide_start(void)
+{
+	struct ide_req *req, **pp;
+	uint32_t secno, nsecs;
+	int i, n;
+
+	while (ide_nactive == 0 && ide_queue) {
+		req = ide_queue;
+		ide_queue = req->ir_next;
+		ide_active[ide_nactive++] = req;
+		secno = req->ir_secno;
+		nsecs = req->ir_nsecs;
+
+	merge:
+		for (pp = &ide_queue; *pp && ide_nactive < IDE_MAXMERGE; pp = &(*pp)->ir_next) {
+			struct ide_req *r = *pp;
+
+			if (r->ir_write != req->ir_write
+			    || nsecs + r->ir_nsecs > IDE_MAXSECS)
+				continue;
+			if (r->ir_secno == secno + nsecs) {
+				ide_active[ide_nactive++] = r;
+			} else if (r->ir_secno + r->ir_nsecs == secno) {
+				memmove(&ide_active[1], &ide_active[0],
+					ide_nactive * sizeof(ide_active[0]));
+				ide_active[0] = r;
+				ide_nactive++;
+				secno = r->ir_secno;
+			} else
+				continue;
+			nsecs += r->ir_nsecs;
+			*pp = r->ir_next;
+			goto merge;
+		}
+
+		for (i = n = 0; i < ide_nactive && n >= 0; i++)
+			n = ide_prd_fill(ide_active[i], n);
+		if (n < 0) {
+			ide_finish(n);
+			continue;
+		}
+		prdt[n - 1].prd_flags = PRD_EOT;
+
+		outb(bmbase + BM_CMD, req->ir_write ? 0 : BM_CMD_READ);
+		outl(bmbase + BM_PRDT, prdt_pa);
+		outb(bmbase + BM_STATUS, BM_STATUS_ERR | BM_STATUS_INTR);
+		ide_command(secno, nsecs,
+			    req->ir_write ? IDE_CMD_WRITE_DMA : IDE_CMD_READ_DMA);
+		outb(bmbase + BM_CMD, (req->ir_write ? 0 : BM_CMD_READ) | BM_CMD_START);
+		fs_stats.ide_commands++;
 	}
+}
 
-	return 0;
+// If the command in flight has finished, complete its requests and
+// start the next one.  Returns 1 if a command finished, 0 if not.
+static int
+ide_poll(void)
+{
+	int st, r;
+
+	if (ide_nactive == 0)
+		return 0;
+
+	st = inb(bmbase + BM_STATUS);
+	if ((st & (BM_STATUS_ACTIVE | BM_STATUS_ERR | BM_STATUS_INTR)) == BM_STATUS_ACTIVE)
+		return 0;
+
+	outb(bmbase + BM_CMD, 0);
+	outb(bmbase + BM_STATUS, BM_STATUS_ERR | BM_STATUS_INTR);
+	r = (ide_wait_ready(1) < 0 || (st & BM_STATUS_ERR)) ? -1 : 0;
+	ide_finish(r);
+	ide_start();
+	return 1;
+}
+
+// Queue req.  ir_done is set, and ir_result filled in, when it finishes.
+// req must stay put until then.
+void
+ide_submit(struct ide_req *req)
+{
+	struct ide_req **pp;
+
+	assert(req->ir_nsecs > 0 && req->ir_nsecs <= IDE_MAXSECS);
+	req->ir_done = 0;
+	req->ir_next = NULL;
+	fs_stats.ide_requests++;
+
+	if (!bmbase || (uintptr_t) req->ir_va % 2 != 0) {
+		// Let the DMA engine go quiet before using PIO
+		while (ide_nactive || ide_queue)
+			if (!ide_poll())
+				sys_yield();
+		req->ir_result = ide_pio(req);
+		req->ir_done = 1;
+		return;
+	}
+
+	for (pp = &ide_queue; *pp; pp = &(*pp)->ir_next)
+		/* do nothing */;
+	*pp = req;
+	ide_start();
+}
+
+// Wait for req to finish, letting other environments run meanwhile.
+void
+ide_wait(struct ide_req *req)
+{
+	while (!req->ir_done)
+		if (!ide_poll())
+			sys_yield();
+}
+
+// Handle a completion interrupt.
+void
+ide_intr(void)
+{
+	if (bmbase)
+		ide_poll();
+}
+
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	struct ide_req req = { .ir_secno = secno, .ir_nsecs = nsecs, .ir_va = dst };
+
+	ide_submit(&req);
+	ide_wait(&req);
+	return req.ir_result;
 }
 
+int
+ide_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	struct ide_req req = { .ir_secno = secno, .ir_nsecs = nsecs,
+			       .ir_va = (void *) src, .ir_write = 1 };
+
+	ide_submit(&req);
+	ide_wait(&req);
+	return req.ir_result;
+}
@@ -0,0 +1,247 @@
+
+#include "fs.h"
+
+// The metadata journal.  Blocks that hold metadata -- the bitmap,
+// directory blocks with their struct Files, indirect, extent and
+// directory index blocks -- are not written back by the block cache
+// like file data.  Code that changes one calls journal_dirty instead
+// of bc_dirty, which adds the block to the running transaction.
+//
+// A commit writes copies of the transaction's blocks to the journal on
+// disk, then a header listing where they belong, and only then writes
+// the blocks in place and clears the header.  If we crash on the way,
+// journal_replay finds the header at the next startup and writes the
+// copies in place again.  Commits are synchronous, so no other disk
+// write comes between a header and the blocks it lists.
+//
+// Many requests share a transaction.  Requests that may change metadata
+// are bracketed by journal_begin and journal_end, and a commit waits
+// until none is in progress, so that none is committed half done.  It
+// happens on the timer tick, on sync, when the transaction has no room
+// for another request, or when the block cache wants to drop a block
+// still in the transaction.  Each request in progress has room for
+// j_opblocks blocks set aside, so the transaction never fills up while
+// one is.
+//
+// File systems without FS_FEAT_JOURNAL, and the tmpfs, have their
+// metadata written back like any other block.
+
+static struct JournalHeader *jhdr = (struct JournalHeader *) JOURNALVA;
+static uint32_t j_cap;			// Blocks a transaction holds; 0 if no journal
+static uint32_t j_opblocks;		// Most blocks one request changes
+static uint32_t j_blocks[JOURNAL_MAXBLOCKS];	// The running transaction
+static uint32_t j_n;
+static uint32_t j_seq;			// Transactions committed
+static uint32_t j_active;		// Requests in progress
+static bool j_wanted;			// Commit once they are done?
+
+#define JCOPY(i)	((void *) (JOURNALVA + (1 + (i)) * BLKSIZE))
+
+// Write the n blocks at va to the disk from blockno on, and wait.
+static void
+journal_write(uint32_t blockno, void *va, uint32_t n)
+{
+	uint32_t k;
+	int r;
+
+	for (; n > 0; n -= k, blockno += k, va += k * BLKSIZE) {
+		k = MIN(n, WB_MAXBLOCKS);
+		if ((r = ide_write(BLKSECTS * blockno, va, BLKSECTS * k)) < 0)
+			panic("journal_write: %e", r);
+	}
+}
+
+void
+journal_init(void)
+{
+	int r;
+
+	if (!(super->s_features & FS_FEAT_JOURNAL))
+		return;
+	if (super->s_njournal < 2 || super->s_journal < 2
+	    || super->s_journal + super->s_njournal > super->s_nblocks)
+		panic("bad journal at block %d", super->s_journal);
+	if ((r = sys_page_alloc(0, jhdr, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("journal_init: %e", r);
+	j_cap = MIN(super->s_njournal - 1, JOURNAL_MAXBLOCKS);
+	j_opblocks = JOURNAL_OPBLOCKS + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+	if (j_opblocks > j_cap)
+		panic("journal of %d blocks is too small", super->s_njournal);
+
+	if ((r = journal_replay()) > 0)
+		cprintf("journal: replayed %d blocks\n", r);
+}
+
+// Write the blocks of the transaction the journal holds, if any, in
+// place, and clear the header.  Returns the number of blocks.
+int
+journal_replay(void)
+{
+	uint32_t i, n, blockno;
+	int r;
+
+	if ((r = ide_read(BLKSECTS * super->s_journal, jhdr, BLKSECTS)) < 0)
+		panic("journal_replay: %e", r);
+	if (jhdr->jh_magic != JOURNAL_MAGIC || jhdr->jh_n == 0)
+		return 0;
+	if ((n = jhdr->jh_n) > j_cap)
+		panic("journal transaction of %d blocks", n);
+	j_seq = MAX(j_seq, jhdr->jh_seq + 1);
+
+	for (i = 0; i < n; i++)
+		if ((r = sys_page_alloc(0, JCOPY(i), PTE_P|PTE_U|PTE_W)) < 0)
+			panic("journal_replay: %e", r);
+	if ((r = ide_read(BLKSECTS * (super->s_journal + 1), JCOPY(0), BLKSECTS * n)) < 0)
+		panic("journal_replay: %e", r);
+
+	// Through the cache, which may hold the old contents already
+	for (i = 0; i < n; i++) {
+		blockno = jhdr->jh_blocks[i];
+		if (blockno < 1 || blockno >= super->s_nblocks
+		    || blockno - super->s_journal < super->s_njournal)
+			panic("journal block %d belongs at bad block %d", i, blockno);
+		memmove(diskaddr(blockno), JCOPY(i), BLKSIZE);
+		flush_block(diskaddr(blockno));
+		sys_page_unmap(0, JCOPY(i));
+	}
+
+	jhdr->jh_n = 0;
+	journal_write(super->s_journal, jhdr, 1);
+	fs_stats.jn_replayed += n;
+	return n;
+}
+
+// Is blockno in the running transaction?
+bool
+journal_pending(uint32_t blockno)
+{
+	uint32_t i;
+
+	for (i = 0; i < j_n; i++)
+		if (j_blocks[i] == blockno)
+			return 1;
+	return 0;
+}
+
+// Note that the metadata block containing addr has been written, so
+// that the next commit writes it.  Outside any request, as while
+// testing, a full transaction is committed first.
+void
+journal_dirty(void *addr)
+{
+	uint32_t blockno = ((uint32_t) addr - DISKMAP) / BLKSIZE;
+
+	if (!j_cap || tmpfs_owns(addr)) {
+		bc_dirty(addr);
+		return;
+	}
+	if (addr < (void*) DISKMAP || addr >= (void*) (DISKMAP + DISKSIZE))
+		panic("journal_dirty of bad va %08x", addr);
+	if (journal_pending(blockno))
+		return;
+	if (j_n == j_cap) {
+		if (j_active > 0)
+			panic("journal: a request changed more than %d blocks", j_opblocks);
+		journal_commit();
+	}
+	j_blocks[j_n++] = blockno;
+}
+
+// Start a request that may change metadata.  While a commit is wanted,
+// or the transaction is short of room, wait for the requests in
+// progress to finish, and commit when the last one has.
+void
+journal_begin(void)
+{
+	while (j_cap && (j_wanted || j_n + (j_active + 1) * j_opblocks > j_cap)) {
+		if (j_active == 0) {
+			journal_commit();
+			break;
+		}
+		j_wanted = 1;
+		worker_wait();
+	}
+	j_active++;
+}
+
+void
+journal_end(void)
+{
+	assert(j_active > 0);
+	if (--j_active == 0 && j_wanted)
+		journal_commit();
+}
+
+// Commit the running transaction now, and start a new one.
+void
+journal_commit(void)
+{
+	static uint32_t blocknos[JOURNAL_MAXBLOCKS];
+	uint32_t i, n = j_n;
+	void *va;
+	int r;
+
+	j_wanted = 0;
+	worker_wakeup();
+	if (n == 0)
+		return;
+
+	// Gather the blocks behind the header, without copying them
+	for (i = 0; i < n; i++) {
+		va = (void *) (DISKMAP + j_blocks[i] * BLKSIZE);
+		assert(va_is_mapped(va));
+		if ((r = sys_page_map(0, va, 0, JCOPY(i), PTE_P|PTE_U)) < 0)
+			panic("journal_commit: %e", r);
+		blocknos[i] = jhdr->jh_blocks[i] = j_blocks[i];
+	}
+	j_n = 0;
+
+	journal_write(super->s_journal + 1, JCOPY(0), n);
+	jhdr->jh_magic = JOURNAL_MAGIC;
+	jhdr->jh_seq = j_seq++;
+	jhdr->jh_n = n;
+	journal_write(super->s_journal, jhdr, 1);
+
+	bc_writeback(blocknos, n);
+	jhdr->jh_n = 0;
+	journal_write(super->s_journal, jhdr, 1);
+
+	for (i = 0; i < n; i++)
+		sys_page_unmap(0, JCOPY(i));
+	fs_stats.jn_commits++;
+	fs_stats.jn_blocks += n;
+}
+
+// Commit now if no request is in progress, and return 1.  Otherwise
+// have the last one to finish commit, and return 0.
+bool
+journal_try_commit(void)
+{
+	if (j_active == 0) {
+		journal_commit();
+		return 1;
+	}
+	j_wanted = 1;
+	return 0;
+}
+
+// Commit everything changed so far.  A worker waits for the requests in
+// progress to finish first; outside the workers there is no waiting,
+// and the commit is only asked for.
+void
+journal_sync(void)
+{
+	if (!j_cap || journal_try_commit() || !worker_self())
+		return;
+	while (j_wanted)
+		worker_wait();
+}
+
+// On a timer tick, commit the transaction once the requests in progress
+// are done.
+void
+journal_tick(void)
+{
+	if (j_n > 0)
+		journal_try_commit();
+}
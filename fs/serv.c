@@ -28,12 +28,27 @@
 //    communicate with the server.  File IDs are a lot like
 //    environment IDs in the kernel.  Use openfile_lookup to translate
 //    file IDs to struct OpenFile.
+//
+// Requests are served by several workers at once (see worker.c).  A
+// request on an open file holds the locks on its OpenFile and its
+// struct File while it runs, so requests to the same file take turns
+// while requests to other files go ahead.
 
 struct OpenFile {
 	uint32_t o_fileid;	// file id
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	struct fslock o_lock;	// held by the request using it
+
+	// Link on openfile_free or openfile_used
+	struct OpenFile *o_next;
+	struct OpenFile **o_pprev;
+
+	// Read-ahead state
+	off_t o_ranext;		// offset a sequential access would start at
+	uint32_t o_rawin;	// read-ahead window, in blocks
+	uint32_t o_raend;	// first file block not read ahead yet
 };
 
 // Max number of open files in the file system at once
@@ -45,42 +60,108 @@ struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// Entries free to open, and entries open or being opened.  A client
+// closes a file by unmapping its Fd page, without telling us, so an
+// open entry goes back on the free list when a sweep finds that no
+// one but us has its Fd page any more.
+static struct OpenFile *openfile_free;
+static struct OpenFile *openfile_used;
+
+// Environment that sends us a tick every FLUSH_INTERVAL msec.
+static envid_t timer_envid;
+
+// Completion rings of the clients that make asynchronous requests, one
+// page for each environment slot from FSRINGVA up, and the environment
+// each one belongs to.
+#define FSRINGVA	0x0d000000
+#define RING(envid)	((struct Fsring *) (FSRINGVA + ENVX(envid) * PGSIZE))
+static envid_t ring_owner[NENV];
+
+static void
+openfile_list_insert(struct OpenFile **head, struct OpenFile *o)
+{
+	if ((o->o_next = *head))
+		(*head)->o_pprev = &o->o_next;
+	*head = o;
+	o->o_pprev = head;
+}
+
+static void
+openfile_list_remove(struct OpenFile *o)
+{
+	if (o->o_next)
+		o->o_next->o_pprev = o->o_pprev;
+	*o->o_pprev = o->o_next;
+	o->o_next = NULL;
+	o->o_pprev = NULL;
+}
 
 void
 serve_init(void)
 {
 	int i;
-	uintptr_t va = FILEVA;
-	for (i = 0; i < MAXOPEN; i++) {
+
+	// Insert back to front, so the lowest entries are used first
+	for (i = MAXOPEN - 1; i >= 0; i--) {
 		opentab[i].o_fileid = i;
-		opentab[i].o_fd = (struct Fd*) va;
-		va += PGSIZE;
+		opentab[i].o_fd = (struct Fd*) (FILEVA + i * PGSIZE);
+		openfile_list_insert(&openfile_free, &opentab[i]);
 	}
 }
 
-// Allocate an open file.
-int
-openfile_alloc(struct OpenFile **o)
+// Put open file o back on the free list.
+static void
+openfile_release(struct OpenFile *o)
 {
-	int i, r;
-
-	// Find an available open-file table entry
-	for (i = 0; i < MAXOPEN; i++) {
-		switch (pageref(opentab[i].o_fd)) {
-		case 0:
-			if ((r = sys_page_alloc(0, opentab[i].o_fd, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			/* fall through */
-		case 1:
-			opentab[i].o_fileid += MAXOPEN;
-			*o = &opentab[i];
-			memset(opentab[i].o_fd, 0, PGSIZE);
-			return (*o)->o_fileid;
+	openfile_list_remove(o);
+	openfile_list_insert(&openfile_free, o);
+	fs_stats.of_inuse--;
+}
+
+// Free the open files that every client has closed.  Entries an open
+// is still filling in, or a request is using, are left for next time.
+static void
+openfile_sweep(void)
+{
+	struct OpenFile *o, *next;
+
+	for (o = openfile_used; o; o = next) {
+		next = o->o_next;
+		if (!fslock_held(&o->o_lock) && pageref(o->o_fd) <= 1) {
+			openfile_release(o);
+			fs_stats.of_closes++;
 		}
 	}
-	return -E_MAX_OPEN;
+}
+
+// Allocate an open file, sweeping for closed ones if none is free.
+int
+openfile_alloc(struct OpenFile **po)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (!openfile_free)
+		openfile_sweep();
+	if (!(o = openfile_free))
+		return -E_MAX_OPEN;
+
+	if (pageref(o->o_fd) == 0
+	    && (r = sys_page_alloc(0, o->o_fd, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	openfile_list_remove(o);
+	openfile_list_insert(&openfile_used, o);
+	fs_stats.of_inuse++;
+	fs_stats.of_opens++;
+
+	o->o_fileid += MAXOPEN;
+	o->o_ranext = 0;
+	o->o_rawin = 0;
+	o->o_raend = 0;
+	fslock_acquire(&o->o_lock);
+	memset(o->o_fd, 0, PGSIZE);
+	*po = o;
+	return o->o_fileid;
 }
 
 // Look up an open file for envid.
@@ -96,6 +177,76 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 	return 0;
 }
 
+// Look up an open file for envid and lock it and its file, waiting
+// for any other request using them to finish.
+static int
+openfile_lock(envid_t envid, uint32_t fileid, struct OpenFile **po)
+{
+	struct OpenFile *o;
+	int r;
+
+	if ((r = openfile_lookup(envid, fileid, &o)) < 0)
+		return r;
+	fslock_acquire(&o->o_lock);
+	// The file may have been closed while we waited
+	if (o->o_fileid != fileid || pageref(o->o_fd) <= 1) {
+		fslock_release(&o->o_lock);
+		return -E_INVAL;
+	}
+	file_lock(o->o_file);
+	*po = o;
+	return 0;
+}
+
+static void
+openfile_unlock(struct OpenFile *o)
+{
+	file_unlock(o->o_file);
+	fslock_release(&o->o_lock);
+}
+
+// f has been written or resized, or a file created in it: bump the
+// generation on the Fd page of every open of f, so that clients stop
+// using the pages of it they have cached.
+static void
+openfile_changed(struct File *f)
+{
+	struct OpenFile *o;
+
+	for (o = openfile_used; o; o = o->o_next)
+		if (o->o_file == f && pageref(o->o_fd) > 1)
+			o->o_fd->fd_file.gen++;
+}
+
+// Note an n-byte access to o at offset and read ahead of it.
+// An access that starts where the last one ended is sequential and
+// doubles the read-ahead window, up to RA_MAXBLOCKS; any other access
+// closes the window.  The blocks of the access itself are brought in
+// along with the window, so a sequential reader's next blocks usually
+// arrive in the same disk command.
+static void
+openfile_readahead(struct OpenFile *o, off_t offset, size_t n)
+{
+	uint32_t start, end;
+
+	if (offset == o->o_ranext)
+		o->o_rawin = o->o_rawin ? MIN(2 * o->o_rawin, RA_MAXBLOCKS) : RA_MINBLOCKS;
+	else {
+		o->o_rawin = 0;
+		o->o_raend = 0;
+	}
+	o->o_ranext = offset + n;
+	if (!o->o_rawin || n == 0)
+		return;
+
+	start = MAX(offset / BLKSIZE, o->o_raend);
+	end = (offset + n - 1) / BLKSIZE + 1 + o->o_rawin;
+	if (start < end) {
+		file_readahead(o->o_file, start, end - start);
+		o->o_raend = end;
+	}
+}
+
 // Open req->req_path in mode req->req_omode, storing the Fd page and
 // permissions to return to the calling environment in *pg_store and
 // *perm_store respectively.
@@ -104,7 +255,7 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 	   void **pg_store, int *perm_store)
 {
 	char path[MAXPATHLEN];
-	struct File *f;
+	struct File *f, *dir;
 	int fileid;
 	int r;
 	struct OpenFile *o;
@@ -116,7 +267,8 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 	memmove(path, req->req_path, MAXPATHLEN);
 	path[MAXPATHLEN-1] = 0;
 
-	// Find an open file ID
+	// Find an open file ID.  The entry stays locked until we are done
+	// with it, so no other open takes it meanwhile.
 	if ((r = openfile_alloc(&o)) < 0) {
 		if (debug)
 			cprintf("openfile_alloc failed: %e", r);
@@ -126,34 +278,40 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 
 	// Open the file
 	if (req->req_omode & O_CREAT) {
-		if ((r = file_create(path, &f)) < 0) {
+		if ((r = file_create(path, &f, &dir)) < 0) {
 			if (!(req->req_omode & O_EXCL) && r == -E_FILE_EXISTS)
 				goto try_open;
 			if (debug)
 				cprintf("file_create failed: %e", r);
-			return r;
+			goto out;
 		}
+		// The new entry changes the directory too
+		openfile_changed(dir);
 	} else {
 try_open:
 		if ((r = file_open(path, &f)) < 0) {
 			if (debug)
 				cprintf("file_open failed: %e", r);
-			return r;
+			goto out;
 		}
 	}
 
 	// Truncate
 	if (req->req_omode & O_TRUNC) {
-		if ((r = file_set_size(f, 0)) < 0) {
+		file_lock(f);
+		r = file_set_size(f, 0);
+		openfile_changed(f);
+		file_unlock(f);
+		if (r < 0) {
 			if (debug)
 				cprintf("file_set_size failed: %e", r);
-			return r;
+			goto out;
 		}
 	}
 	if ((r = file_open(path, &f)) < 0) {
 		if (debug)
 			cprintf("file_open failed: %e", r);
-		return r;
+		goto out;
 	}
 
 	// Save the file pointer
@@ -172,10 +330,16 @@ try_open:
 	// store its permission in *perm_store
 	*pg_store = o->o_fd;
 	*perm_store = PTE_P|PTE_U|PTE_W|PTE_SHARE;
+	r = 0;
 
-	return 0;
+out:
+	if (r < 0)
+		openfile_release(o);
+	fslock_release(&o->o_lock);
+	return r;
 }
 
+
 // Set the size of req->req_fileid to req->req_size bytes, truncating
 // or extending the file as necessary.
 int
@@ -190,14 +354,18 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 	// Every file system IPC call has the same general structure.
 	// Here's how it goes.
 
-	// First, use openfile_lookup to find the relevant open file.
+	// First, use openfile_lock to find the relevant open file.
 	// On failure, return the error code to the client with ipc_send.
-	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+	// It comes back locked, so unlock it when done.
+	if ((r = openfile_lock(envid, req->req_fileid, &o)) < 0)
 		return r;
 
 	// Second, call the relevant file system function (from fs/fs.c).
 	// On failure, return the error code to the client.
-	return file_set_size(o->o_file, req->req_size);
+	r = file_set_size(o->o_file, req->req_size);
+	openfile_changed(o->o_file);
+	openfile_unlock(o);
+	return r;
 }
 
 // Read at most ipc->read.req_n bytes from the current seek position
@@ -211,18 +379,20 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	struct Fsret_read *ret = &ipc->readRet;
 	struct OpenFile *o = NULL;
 	int r = 0;
+	size_t n = 0;
 	ssize_t count = 0;
 
 	if (debug)
 		cprintf("serve_read %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
 
-	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+	if ((r = openfile_lock(envid, req->req_fileid, &o)) < 0)
 		return r;
 
-	if ((count = file_read(o->o_file, ret->ret_buf, req->req_n, o->o_fd->fd_offset)) < 0)
-		return count;
-
-	o->o_fd->fd_offset += count;
+	n = MIN(req->req_n, sizeof(ret->ret_buf));
+	openfile_readahead(o, o->o_fd->fd_offset, n);
+	if ((count = file_read(o->o_file, ret->ret_buf, n, o->o_fd->fd_offset)) >= 0)
+		o->o_fd->fd_offset += count;
+	openfile_unlock(o);
 	return count;
 }
 
@@ -242,15 +412,152 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	int r;
 	int write_size = 0;
 
-	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+	if ((r = openfile_lock(envid, req->req_fileid, &o)) < 0)
 		return r;
 	write_size = file_write(o->o_file, req->req_buf, req->req_n, o->o_fd->fd_offset);
 	o->o_fd->fd_offset += write_size;
+	openfile_changed(o->o_file);
+	openfile_unlock(o);
 	if (debug)
 		cprintf("serve_write success %08x %08x %08x %s\n", envid, write_size, o->o_fd->fd_offset, req->req_buf);
 	return write_size;
 }
 
+// Read at most ipc->read.req_n bytes from the current seek position
+// in ipc->read.req_fileid, up to what fits in FSBULK_PAGES blocks, and
+// update the seek position.  Rather than copying the data, return the
+// block cache pages that hold it, read-only, in *pg_store and
+// *npages_store; a last block that runs past the end of the file goes
+// out as a copy, so the caller sees nothing beyond the end.  Set
+// ipc->readPagesRet.ret_offset to the offset the data was read from.
+// Returns the number of bytes read, or < 0 on error.
+int
+serve_read_pages(envid_t envid, union Fsipc *ipc, void **pg_store,
+		 size_t *npages_store, int *perm_store)
+{
+	struct Fsreq_read *req = &ipc->read;
+	struct OpenFile *o;
+	char *reply, *pg, *blk;
+	off_t off, size;
+	uint32_t bno;
+	size_t n;
+	int r;
+
+	if (debug)
+		cprintf("serve_read_pages %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lock(envid, req->req_fileid, &o)) < 0)
+		return r;
+	off = o->o_fd->fd_offset;
+	size = o->o_file->f_size;
+	n = off < size ? MIN(req->req_n, size - off) : 0;
+	n = MIN(n, FSBULK_PAGES * BLKSIZE - off % BLKSIZE);
+	ipc->readPagesRet.ret_offset = off;
+	if (n == 0) {
+		r = 0;
+		goto out;
+	}
+
+	openfile_readahead(o, off, n);
+	reply = worker_reply();
+	for (bno = off / BLKSIZE, pg = reply; bno * BLKSIZE < off + n; bno++, pg += PGSIZE) {
+		if ((r = file_get_block(o->o_file, bno, &blk)) < 0)
+			goto out;
+		if ((bno + 1) * BLKSIZE > size) {
+			if ((r = sys_page_alloc(0, pg, PTE_P|PTE_U|PTE_W)) < 0)
+				goto out;
+			memmove(pg, blk, size - bno * BLKSIZE);
+		} else {
+			// Make sure the block is in the cache before mapping it
+			*(volatile char *) blk;
+			if ((r = sys_page_map(0, blk, 0, pg, PTE_P|PTE_U)) < 0)
+				goto out;
+		}
+	}
+
+	o->o_fd->fd_offset += n;
+	*pg_store = reply;
+	*npages_store = (pg - reply) / PGSIZE;
+	*perm_store = PTE_P|PTE_U;
+	r = n;
+out:
+	openfile_unlock(o);
+	return r;
+}
+
+// Write ipc->writePages.req_n bytes, sent in the npages - 1 pages that
+// follow the request page, to ipc->writePages.req_fileid at the current
+// seek position, and update the seek position.  Returns the number of
+// bytes written, or < 0 on error.
+int
+serve_write_pages(envid_t envid, union Fsipc *ipc, size_t npages)
+{
+	struct Fsreq_write_pages *req = &ipc->writePages;
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_write_pages %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if (req->req_n > (npages - 1) * PGSIZE)
+		return -E_INVAL;
+	if ((r = openfile_lock(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((r = file_write(o->o_file, (char *) ipc + PGSIZE, req->req_n,
+			    o->o_fd->fd_offset)) > 0)
+		o->o_fd->fd_offset += r;
+	openfile_changed(o->o_file);
+	openfile_unlock(o);
+	return r;
+}
+
+// Read directory ipc->readdir.req_fileid from the current seek position,
+// packing as many of its files as fit into ipc->readdirRet, and move
+// the seek position past them.  Returns the number of bytes packed, 0
+// at the end of the directory, or < 0 on error.
+int
+serve_readdir(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_readdir *req = &ipc->readdir;
+	struct Fsret_readdir *ret = &ipc->readdirRet;
+	struct OpenFile *o;
+	struct Fsdirent *d;
+	struct File *f;
+	uint32_t ent;
+	size_t len, n;
+	int r;
+
+	if (debug)
+		cprintf("serve_readdir %08x %08x\n", envid, req->req_fileid);
+
+	if ((r = openfile_lock(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (o->o_file->f_type != FTYPE_DIR) {
+		r = -E_INVAL;
+		goto out;
+	}
+
+	// The request is overwritten from here on
+	n = 0;
+	ent = ROUNDUP(o->o_fd->fd_offset, sizeof(struct File)) / sizeof(struct File);
+	for (; dir_read(o->o_file, &ent, &f) == 0; ent++) {
+		len = strlen(f->f_name);
+		if (n + ROUNDUP(sizeof(*d) + len + 1, 4) > sizeof(ret->ret_buf))
+			break;
+		d = (struct Fsdirent *) (ret->ret_buf + n);
+		d->d_size = f->f_size;
+		d->d_type = f->f_type;
+		d->d_reclen = ROUNDUP(sizeof(*d) + len + 1, 4);
+		memmove(d->d_name, f->f_name, len + 1);
+		n += d->d_reclen;
+	}
+	o->o_fd->fd_offset = ent * sizeof(struct File);
+	r = n;
+out:
+	openfile_unlock(o);
+	return r;
+}
+
 // Stat ipc->stat.req_fileid.  Return the file's struct Stat to the
 // caller in ipc->statRet.
 int
@@ -264,12 +571,13 @@ serve_stat(envid_t envid, union Fsipc *ipc)
 	if (debug)
 		cprintf("serve_stat %08x %08x\n", envid, req->req_fileid);
 
-	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+	if ((r = openfile_lock(envid, req->req_fileid, &o)) < 0)
 		return r;
 
 	strcpy(ret->ret_name, o->o_file->f_name);
 	ret->ret_size = o->o_file->f_size;
 	ret->ret_isdir = (o->o_file->f_type == FTYPE_DIR);
+	openfile_unlock(o);
 	return 0;
 }
 
@@ -283,13 +591,68 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 	if (debug)
 		cprintf("serve_flush %08x %08x\n", envid, req->req_fileid);
 
-	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+	if ((r = openfile_lock(envid, req->req_fileid, &o)) < 0)
 		return r;
 	file_flush(o->o_file);
+	openfile_unlock(o);
 	return 0;
 }
 
 
+// Map the block of req->req_fileid containing byte req->req_offset
+// (which must be block-aligned) into the caller, storing the page and
+// permissions to send in *pg_store and *perm_store.  The page is the
+// block-cache page itself, so the caller sees later writes to the
+// block until it is evicted; it is always sent read-only.  The last block of a file is
+// copied into a fresh page with the bytes past end-of-file zeroed, so
+// stale data is never exposed.
+// Returns the number of valid file bytes in the page, 0 (and no page)
+// if the offset is at or past end-of-file, or < 0 on error.
+int
+serve_map(envid_t envid, struct Fsreq_map *req,
+	  void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk, *scratch;
+	int r, n;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if (req->req_offset < 0 || req->req_offset % BLKSIZE != 0)
+		return -E_INVAL;
+	if ((r = openfile_lock(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_offset >= o->o_file->f_size) {
+		r = 0;
+		goto out;
+	}
+
+	openfile_readahead(o, req->req_offset, BLKSIZE);
+	if ((r = file_get_block(o->o_file, req->req_offset / BLKSIZE, &blk)) < 0)
+		goto out;
+	n = MIN(BLKSIZE, o->o_file->f_size - req->req_offset);
+
+	if (n < BLKSIZE) {
+		// The worker's scratch page is ours until the reply is sent
+		scratch = worker_scratch();
+		if ((r = sys_page_alloc(0, scratch, PTE_P|PTE_U|PTE_W)) < 0)
+			goto out;
+		memmove(scratch, blk, n);
+		blk = scratch;
+	} else {
+		// Make sure the block is in the cache before sending it
+		*(volatile char *) blk;
+	}
+
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U;
+	r = n;
+out:
+	openfile_unlock(o);
+	return r;
+}
+
 int
 serve_sync(envid_t envid, union Fsipc *req)
 {
@@ -297,32 +660,165 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Copy the file server's counters to the request page.
+int
+serve_stats(envid_t envid, union Fsipc *ipc)
+{
+	ipc->statsRet = fs_stats;
+	return 0;
+}
+
+// Keep the request page as envid's completion ring, in place of any
+// ring an earlier environment in its slot had.
+int
+serve_ring(envid_t envid, union Fsipc *ipc)
+{
+	int r;
+
+	if ((r = sys_page_map(0, ipc, 0, RING(envid), PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	ring_owner[ENVX(envid)] = envid;
+	return 0;
+}
+
+// Post the result of envid's asynchronous request tag to its ring, and
+// wake envid up if it is waiting.  A client that has no ring, or has
+// overfilled it, just misses the completion.
+static void
+ring_post(envid_t envid, uint32_t tag, int result)
+{
+	struct Fsring *ring = RING(envid);
+	volatile struct Fscomp *c;
+	int r;
+
+	if (ring_owner[ENVX(envid)] != envid
+	    || ring->r_tail - ring->r_head >= FSRING_SIZE)
+		return;
+	c = &ring->r_comp[ring->r_tail % FSRING_SIZE];
+	c->c_tag = tag;
+	c->c_result = result;
+	ring->r_tail++;
+
+	if (xchg(&ring->r_waiting, 0))
+		while ((r = sys_ipc_try_send(envid, 0, (void *) UTOP, 0)) == -E_IPC_NOT_RECV)
+			sys_yield();
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
-	// Open is handled specially because it passes pages
+	// Open, map and the bulk requests are handled specially because
+	// they pass pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
+	/* [FSREQ_MAP] =	(fshandler)serve_map, */
+	/* [FSREQ_READ_PAGES] =	(fshandler)serve_read_pages, */
+	/* [FSREQ_WRITE_PAGES] = (fshandler)serve_write_pages, */
 	[FSREQ_READ] =		serve_read,
 	[FSREQ_STAT] =		serve_stat,
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_STATS] =		serve_stats,
+	[FSREQ_RING] =		serve_ring,
+	[FSREQ_READDIR] =	serve_readdir
 };
 
+// Serve request req from whom, which came with the npages pages from
+// ipc on mapped with permissions perm, and send the reply.  Runs in a
+// worker.
+void
+serve_request(envid_t whom, uint32_t req, union Fsipc *ipc, int perm,
+	      size_t npages)
+{
+	uint32_t code = (req & FSREQ_ASYNC) ? FSREQ_CODE(req) : req;
+	bool changes;
+	size_t npg;
+	void *pg;
+	int r;
+
+	// Requests that may change metadata join the running transaction.
+	// That is nearly all of them: even reads fill holes with new blocks.
+	changes = code != FSREQ_SYNC && code != FSREQ_STATS && code != FSREQ_RING;
+	if (changes)
+		journal_begin();
+
+	pg = NULL;
+	npg = 1;
+	if ((req & FSREQ_ASYNC)
+	    && (code == FSREQ_OPEN || code == FSREQ_MAP || code == FSREQ_RING
+		|| code == FSREQ_READ_PAGES)) {
+		r = -E_INVAL;
+	} else if (code == FSREQ_OPEN) {
+		r = serve_open(whom, (struct Fsreq_open*)ipc, &pg, &perm);
+	} else if (code == FSREQ_MAP) {
+		r = serve_map(whom, (struct Fsreq_map*)ipc, &pg, &perm);
+	} else if (code == FSREQ_READ_PAGES) {
+		r = serve_read_pages(whom, ipc, &pg, &npg, &perm);
+	} else if (code == FSREQ_WRITE_PAGES) {
+		r = serve_write_pages(whom, ipc, npages);
+	} else if (code < ARRAY_SIZE(handlers) && handlers[code]) {
+		r = handlers[code](whom, ipc);
+	} else {
+		cprintf("Invalid request code %d from %08x\n", code, whom);
+		r = -E_INVAL;
+	}
+	if (changes)
+		journal_end();
+
+	if (req & FSREQ_ASYNC)
+		ring_post(whom, FSREQ_TAG(req), r);
+	else
+		ipc_send_pages(whom, r, pg, npg, perm);
+}
+
 void
 serve(void)
 {
 	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	int perm;
+	size_t npages;
+	union Fsipc *ipc;
 
 	while (1) {
+		// With every worker waiting for the disk, there is nowhere
+		// to take another request, so wait for the disk instead
+		if (!(ipc = worker_next())) {
+			ide_intr();
+			worker_wakeup();
+			worker_run();
+			if (!worker_next())
+				sys_yield();
+			continue;
+		}
+
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		npages = 1 + FSBULK_PAGES;
+		req = ipc_recv_pages((int32_t *) &whom, ipc, &npages, &perm);
+
+		// The kernel tells us the disk finished a command
+		if (whom == 0 && req == IRQ_IDE) {
+			ide_intr();
+			worker_wakeup();
+			worker_run();
+			continue;
+		}
+		// Workers whose reads bc_poll finishes run now, whatever
+		// the message was, so none waits on a disk that is idle
+		bc_poll();
+		worker_run();
+
+		// The flush timer ticked
+		if (whom == timer_envid) {
+			bc_flusher(1);
+			journal_tick();
+			openfile_sweep();
+			continue;
+		}
+
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
-				req, whom, uvpt[PGNUM(fsreq)], fsreq);
+				req, whom, uvpt[PGNUM(ipc)], ipc);
 
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
@@ -331,17 +827,8 @@ serve(void)
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
-		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		worker_start(ipc, whom, req, perm, npages);
+		bc_flusher(0);
 	}
 }
 
@@ -349,15 +836,39 @@ void
 umain(int argc, char **argv)
 {
 	static_assert(sizeof(struct File) == 256);
+	envid_t fs_envid = sys_getenvid();
+	struct Trapframe tf;
+	int r;
+
 	binaryname = "fs";
 	cprintf("FS is running\n");
 
+	// fork off the timer that drives the flusher, before anything is
+	// mapped that it should not share
+	if ((timer_envid = fork()) < 0)
+		panic("error forking");
+	else if (timer_envid == 0) {
+		timer(fs_envid, FLUSH_INTERVAL);
+		return;
+	}
+
+	// The timer needs no port I/O: once it waits for us to start
+	// it, clear the IOPL it inherited (sys_env_set_trapframe does)
+	while (envs[ENVX(timer_envid)].env_status != ENV_NOT_RUNNABLE
+	       || !envs[ENVX(timer_envid)].env_ipc_recving)
+		sys_yield();
+	tf = envs[ENVX(timer_envid)].env_tf;
+	if ((r = sys_env_set_trapframe(timer_envid, &tf)) < 0)
+		panic("sys_env_set_trapframe: %e", r);
+	ipc_send(timer_envid, 0, 0, 0);
+
 	// Check that we are able to do I/O
 	outw(0x8A00, 0x8A00);
 	cprintf("FS can do I/O\n");
 
 	serve_init();
 	fs_init();
+	worker_init();
 	serve();
 }
 
@@ -5,13 +5,23 @@
 
 static char *msg = "This is the NEW message of the day!\n\n";
 
+// Is f's metadata safe: on disk, or in the running journal transaction?
+static bool
+file_meta_saved(struct File *f)
+{
+	return !(uvpt[PGNUM(f)] & PTE_D)
+		|| journal_pending(((uint32_t) f - DISKMAP) / BLKSIZE);
+}
+
 void
 fs_test(void)
 {
 	struct File *f;
-	int r;
+	int r, i;
 	char *blk;
-	uint32_t *bits;
+	uint32_t *bits, evictions, requests, bno, hits;
+	char name[MAXNAMELEN];
+	struct JournalHeader *jh;
 
 	// back up bitmap
 	if ((r = sys_page_alloc(0, (void*) PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
@@ -27,6 +37,18 @@ fs_test(void)
 	assert(!(bitmap[r/32] & (1 << (r%32))));
 	cprintf("alloc_block is good\n");
 
+	// allocate next to a given block when it is free
+	if ((i = alloc_block()) < 0)
+		panic("alloc_block 2: %e", i);
+	if (bits[(i+1)/32] & (1 << ((i+1)%32))) {
+		if ((r = alloc_block_near(i + 1)) < 0)
+			panic("alloc_block_near: %e", r);
+		assert(r == i + 1);
+		free_block(r);
+	}
+	free_block(i);
+	cprintf("alloc_block_near is good\n");
+
 	if ((r = file_open("/not-found", &f)) < 0 && r != -E_NOT_FOUND)
 		panic("file_open /not-found: %e", r);
 	else if (r == 0)
@@ -50,18 +72,193 @@ fs_test(void)
 	if ((r = file_set_size(f, 0)) < 0)
 		panic("file_set_size: %e", r);
 	assert(f->f_direct[0] == 0);
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
+	assert(file_meta_saved(f));
 	cprintf("file_truncate is good\n");
 
 	if ((r = file_set_size(f, strlen(msg))) < 0)
 		panic("file_set_size 2: %e", r);
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
+	assert(file_meta_saved(f));
 	if ((r = file_get_block(f, 0, &blk)) < 0)
 		panic("file_get_block 2: %e", r);
 	strcpy(blk, msg);
 	assert((uvpt[PGNUM(blk)] & PTE_D));
 	file_flush(f);
 	assert(!(uvpt[PGNUM(blk)] & PTE_D));
-	assert(!(uvpt[PGNUM(f)] & PTE_D));
+	assert(file_meta_saved(f));
 	cprintf("file rewrite is good\n");
+
+	// shrink the block cache and touch every block in use
+	evictions = fs_stats.bc_evictions;
+	bc_set_limit(8);
+	for (i = 2; i < super->s_nblocks; i++)
+		if (!block_is_free(i))
+			*(volatile char*)diskaddr(i);
+	assert(fs_stats.bc_resident <= 8);
+	assert(fs_stats.bc_evictions > evictions);
+	if ((r = file_get_block(f, 0, &blk)) < 0)
+		panic("file_get_block 3: %e", r);
+	if (strcmp(blk, msg) != 0)
+		panic("file_get_block returned wrong data after eviction");
+	bc_set_limit(BC_MAXBLOCKS);
+	cprintf("block cache eviction is good\n");
+
+	// dirty a run of blocks in use and check that a sync writes them
+	// with fewer disk requests than blocks
+	for (i = 2; i + 4 < super->s_nblocks; i++)
+		if (!block_is_free(i) && !block_is_free(i + 1)
+		    && !block_is_free(i + 2) && !block_is_free(i + 3))
+			break;
+	for (r = i; r < i + 4; r++) {
+		*(volatile char*)diskaddr(r) = *(volatile char*)diskaddr(r);
+		bc_dirty(diskaddr(r));
+	}
+	requests = fs_stats.ide_requests;
+	fs_sync();
+	assert(fs_stats.ide_requests - requests < 4);
+	for (r = i; r < i + 4; r++)
+		assert(!va_is_dirty(diskaddr(r)));
+	cprintf("fs_sync writeback is good\n");
+
+	// everything written through the file operations is in the dirty
+	// set, so a sync leaves no dirty block behind
+	if ((r = file_write(f, msg, strlen(msg), BLKSIZE)) < 0)
+		panic("file_write: %e", r);
+	fs_sync();
+	for (i = 1; i < super->s_nblocks; i++)
+		assert(!va_is_mapped(diskaddr(i)) || !va_is_dirty(diskaddr(i)));
+	if ((r = file_set_size(f, strlen(msg))) < 0)
+		panic("file_set_size 3: %e", r);
+	fs_sync();
+	for (i = 1; i < super->s_nblocks; i++)
+		assert(!va_is_mapped(diskaddr(i)) || !va_is_dirty(diskaddr(i)));
+	cprintf("dirty block tracking is good\n");
+
+	// a file with holes takes an extent per block, and once they no
+	// longer fit in the File they move out to an extent block
+	if ((r = file_create("/extents", &f, NULL)) < 0 && r != -E_FILE_EXISTS)
+		panic("file_create /extents: %e", r);
+	if (r < 0 && (r = file_open("/extents", &f)) < 0)
+		panic("file_open /extents: %e", r);
+	if (f->f_flags & FFLAG_EXTENTS) {
+		if ((r = file_set_size(f, (4 * NFILEEXTENT + 4) * BLKSIZE)) < 0)
+			panic("file_set_size 4: %e", r);
+		for (i = 0; i < 2 * NFILEEXTENT + 2; i++) {
+			if ((r = file_get_block(f, 2 * i, &blk)) < 0)
+				panic("file_get_block 4: %e", r);
+			blk[0] = i;
+			bc_dirty(blk);
+		}
+		assert(f->f_depth == 1);
+		for (i = 0; i < 2 * NFILEEXTENT + 2; i++) {
+			assert(file_map_block(f, 2 * i, &bno, 0) == 0 && bno != 0);
+			assert(((char*)diskaddr(bno))[0] == i);
+			assert(file_map_block(f, 2 * i + 1, &bno, 0) == 0 && bno == 0);
+		}
+		if ((r = file_set_size(f, BLKSIZE)) < 0)
+			panic("file_set_size 5: %e", r);
+		assert(f->f_depth == 0 && f->f_nextent == 1);
+		cprintf("extents are good\n");
+	}
+
+	// names in an indexed directory are found through its index
+	if (super->s_root.f_flags & FFLAG_DIRINDEX) {
+		for (i = 0; i < 40; i++) {
+			snprintf(name, sizeof(name), "/indexed%d", i);
+			if ((r = file_create(name, &f, NULL)) < 0 && r != -E_FILE_EXISTS)
+				panic("file_create %s: %e", name, r);
+		}
+		for (i = 0; i < 40; i++) {
+			snprintf(name, sizeof(name), "/indexed%d", i);
+			if ((r = file_open(name, &f)) < 0)
+				panic("file_open %s: %e", name, r);
+			assert(strcmp(f->f_name, name + 1) == 0);
+		}
+		assert(file_open("/indexed-not-found", &f) == -E_NOT_FOUND);
+		assert(super->s_root.f_flags & FFLAG_DIRINDEX);
+		cprintf("directory index is good\n");
+	}
+
+	// repeated lookups, found or not, come from the path cache, and
+	// creating a name replaces what the cache knew about it
+	if ((r = file_open("/newmotd", &f)) < 0)
+		panic("file_open /newmotd 2: %e", r);
+	hits = fs_stats.dc_hits;
+	if ((r = file_open("/newmotd", &f)) < 0)
+		panic("file_open /newmotd 3: %e", r);
+	assert(fs_stats.dc_hits == hits + 1);
+	if (file_open("/dcache", &f) == -E_NOT_FOUND) {
+		hits = fs_stats.dc_hits;
+		assert(file_open("/dcache", &f) == -E_NOT_FOUND);
+		assert(fs_stats.dc_hits == hits + 1);
+		if ((r = file_create("/dcache", &f, NULL)) < 0)
+			panic("file_create /dcache: %e", r);
+	}
+	if ((r = file_open("/dcache", &f)) < 0)
+		panic("file_open /dcache: %e", r);
+	cprintf("path cache is good\n");
+
+	// files under /tmp live in memory, up to the tmpfs limit, and
+	// give their memory back when they shrink
+	if ((r = file_create("/" TMPFS_NAME "/test", &f, NULL)) < 0)
+		panic("file_create /%s/test: %e", TMPFS_NAME, r);
+	assert(tmpfs_owns(f) && f->f_size == 0);
+	bno = fs_stats.tf_blocks;
+	for (i = 0; i < 3; i++)
+		if ((r = file_write(f, msg, strlen(msg), i * BLKSIZE)) < 0)
+			panic("file_write /%s/test: %e", TMPFS_NAME, r);
+	assert(fs_stats.tf_blocks == bno + 3);
+	assert(file_map_block(f, 2, &bno, 0) == 0 && bno >= TMPFS_BLK0);
+	assert(strncmp(diskaddr(bno), msg, strlen(msg)) == 0);
+	tmpfs_set_limit(fs_stats.tf_blocks);
+	assert(file_write(f, msg, strlen(msg), 3 * BLKSIZE) == -E_NO_DISK);
+	tmpfs_set_limit(TMPFS_DEFBLOCKS);
+	bno = fs_stats.tf_blocks;
+	if ((r = file_set_size(f, 0)) < 0)
+		panic("file_set_size /%s/test: %e", TMPFS_NAME, r);
+	assert(fs_stats.tf_blocks == bno - 3);
+	if ((r = file_open("/" TMPFS_NAME "/test", &f)) < 0)
+		panic("file_open /%s/test: %e", TMPFS_NAME, r);
+	cprintf("tmpfs is good\n");
+
+	// metadata changes wait in the running transaction until a commit
+	// writes them, and a transaction left in the journal is replayed
+	if (super->s_features & FS_FEAT_JOURNAL) {
+		if ((r = file_open("/newmotd", &f)) < 0)
+			panic("file_open /newmotd 4: %e", r);
+		bno = ((uint32_t) f - DISKMAP) / BLKSIZE;
+		if ((r = file_set_size(f, f->f_size)) < 0)
+			panic("file_set_size 6: %e", r);
+		assert(journal_pending(bno) && va_is_dirty(f));
+		hits = fs_stats.jn_commits;
+		fs_sync();
+		assert(!journal_pending(bno) && !va_is_dirty(f));
+		assert(fs_stats.jn_commits == hits + 1);
+
+		if ((r = alloc_block()) < 0)
+			panic("alloc_block 3: %e", r);
+		bno = r;
+		fs_sync();
+		jh = (struct JournalHeader *) (2 * PGSIZE);
+		if ((r = sys_page_alloc(0, jh, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		blk = (char *) bits;
+		memset(blk, 0, BLKSIZE);
+		strcpy(blk, msg);
+		jh->jh_magic = JOURNAL_MAGIC;
+		jh->jh_seq = 0;
+		jh->jh_n = 1;
+		jh->jh_blocks[0] = bno;
+		if ((r = ide_write(BLKSECTS * (super->s_journal + 1), blk, BLKSECTS)) < 0
+		    || (r = ide_write(BLKSECTS * super->s_journal, jh, BLKSECTS)) < 0)
+			panic("ide_write: %e", r);
+		assert(journal_replay() == 1);
+		assert(strcmp(diskaddr(bno), msg) == 0);
+		sys_page_unmap(0, diskaddr(bno));
+		assert(strcmp(diskaddr(bno), msg) == 0);
+		assert(journal_replay() == 0);
+		free_block(bno);
+		fs_sync();
+		sys_page_unmap(0, jh);
+		cprintf("journal is good\n");
+	}
 }
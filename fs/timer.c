@@ -0,0 +1,26 @@
+#include "fs.h"
+
+// Send the file system server a tick every interval msec, so that it
+// writes back blocks that have been dirty for too long even when no
+// requests come in.  The server starts us with an IPC once it has taken
+// away the I/O privilege we inherited from it.
+void
+timer(envid_t fs_envid, uint32_t interval)
+{
+	int r;
+	uint32_t stop;
+
+	binaryname = "fs_timer";
+	ipc_recv(NULL, 0, NULL);
+	stop = sys_time_msec() + interval;
+
+	while (1) {
+		while ((r = sys_time_msec()) < stop && r >= 0)
+			sys_yield();
+		if (r < 0)
+			panic("sys_time_msec: %e", r);
+
+		ipc_send(fs_envid, 0, 0, 0);
+		stop = sys_time_msec() + interval;
+	}
+}
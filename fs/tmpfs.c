@@ -0,0 +1,96 @@
+
+#include "fs.h"
+
+// The tmpfs is a file system in memory, mounted over /tmp.  Its files
+// are struct Files like any other, and their blocks are found the same
+// way, but the blocks are pages of our own memory rather than disk
+// blocks: tmpfs block i is the page at TMPFSVA + i * BLKSIZE, and is
+// numbered TMPFS_BLK0 + i so that it cannot be taken for a disk block.
+// Nothing in the tmpfs is ever written back; it is gone when the file
+// system server is.
+//
+// Block 0 holds the root directory.  Blocks are allocated from
+// tmpfs_bitmap, and at most tmpfs_limit of them at once.
+
+struct File *tmpfs_root;
+
+static uint32_t tmpfs_bitmap[TMPFS_MAXBLOCKS / 32];	// set if in use
+static uint32_t tmpfs_limit = TMPFS_DEFBLOCKS;
+
+void
+tmpfs_init(void)
+{
+	int r;
+
+	if ((r = tmpfs_alloc_block()) != TMPFS_BLK0)
+		panic("tmpfs_init: %e", r);
+	tmpfs_root = diskaddr(TMPFS_BLK0);
+	strcpy(tmpfs_root->f_name, TMPFS_NAME);
+	tmpfs_root->f_type = FTYPE_DIR;
+	fs_stats.tf_limit = tmpfs_limit;
+}
+
+// Is va tmpfs memory?
+bool
+tmpfs_owns(void *va)
+{
+	return (void *) TMPFSVA <= va
+		&& va < (void *) (TMPFSVA + TMPFS_MAXBLOCKS * BLKSIZE);
+}
+
+// Return the address of tmpfs block blockno.
+void *
+tmpfs_addr(uint32_t blockno)
+{
+	if (blockno < TMPFS_BLK0 || blockno >= TMPFS_BLK0 + TMPFS_MAXBLOCKS)
+		panic("bad block number %08x in tmpfs_addr", blockno);
+	return (void *) (TMPFSVA + (blockno - TMPFS_BLK0) * BLKSIZE);
+}
+
+// Allocate a zeroed tmpfs block.
+//
+// Returns the block number, -E_NO_DISK if the tmpfs is at its limit,
+// or -E_NO_MEM if there is no memory for the block.
+int
+tmpfs_alloc_block(void)
+{
+	uint32_t i, w;
+	int r;
+
+	if (fs_stats.tf_blocks >= tmpfs_limit)
+		return -E_NO_DISK;
+	for (w = 0; w < ARRAY_SIZE(tmpfs_bitmap); w++)
+		if (tmpfs_bitmap[w] != ~0U)
+			break;
+	assert(w < ARRAY_SIZE(tmpfs_bitmap));
+	i = w * 32 + __builtin_ctz(~tmpfs_bitmap[w]);
+
+	if ((r = sys_page_alloc(0, tmpfs_addr(TMPFS_BLK0 + i),
+				PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	tmpfs_bitmap[w] |= 1 << (i % 32);
+	fs_stats.tf_blocks++;
+	return TMPFS_BLK0 + i;
+}
+
+// Free tmpfs block blockno, and the memory it held.
+void
+tmpfs_free_block(uint32_t blockno)
+{
+	uint32_t i = blockno - TMPFS_BLK0;
+
+	if (blockno == TMPFS_BLK0 || !(tmpfs_bitmap[i / 32] & (1 << (i % 32))))
+		panic("tmpfs_free_block: block %08x is not in use", blockno);
+	sys_page_unmap(0, tmpfs_addr(blockno));
+	tmpfs_bitmap[i / 32] &= ~(1 << (i % 32));
+	fs_stats.tf_blocks--;
+}
+
+// Let the tmpfs hold at most nblocks blocks, root directory included.
+// Lowering the limit frees nothing; it only holds off allocations.
+void
+tmpfs_set_limit(uint32_t nblocks)
+{
+	tmpfs_limit = MIN(MAX(nblocks, 1), TMPFS_MAXBLOCKS);
+	fs_stats.tf_limit = tmpfs_limit;
+}
@@ -0,0 +1,278 @@
+/*
+ * Worker threads for the file system server.
+ *
+ * Requests are served by NWORKERS user-level threads, which share the
+ * server's address space and so its block cache.  The main thread
+ * receives each request into the request page of an idle worker and
+ * switches to that worker to serve it.  A worker that misses in the
+ * block cache, or wants a lock another worker holds, switches back to
+ * the main thread, which goes on receiving and serving other requests
+ * until the disk interrupt or the release comes in.  Workers switch
+ * only at those points, so file system code between them runs without
+ * interruption, as it did with a single thread.
+ *
+ * Each worker has a slot of WORKER_SLOT bytes at WORKERVA: an unmapped
+ * guard page, WORKER_STKPAGES of stack, the page requests are received
+ * into followed by room for FSBULK_PAGES of bulk write data, a scratch
+ * page for building replies, and FSBULK_PAGES to gather the pages of a
+ * bulk read reply in.
+ */
+
+#include "fs.h"
+
+struct worker {
+	uint32_t w_esp;			// saved stack pointer while switched out
+	bool w_busy;			// serving a request?
+	envid_t w_whom;			// the request
+	uint32_t w_req;
+	int w_perm;
+	size_t w_npages;		// pages received with it
+	bool w_replied;			// has the reply window been used?
+};
+
+static struct worker workers[NWORKERS];
+static struct worker *curworker;	// NULL in the main thread
+static uint32_t main_esp;
+static bool worker_woken;		// has a waiting worker maybe got what it wanted?
+
+// Locks on files.  A struct File lives in the block cache, not in
+// memory of our own, so the lock on one is found by its address.
+static struct filelock {
+	struct File *fl_file;		// NULL if this entry is free
+	struct worker *fl_owner;
+} filelocks[2 * NWORKERS];
+
+#define WSLOT(w)	(WORKERVA + ((w) - workers) * WORKER_SLOT)
+#define WSTACKTOP(w)	(WSLOT(w) + (1 + WORKER_STKPAGES) * PGSIZE)
+#define WREQ(w)		((union Fsipc *) WSTACKTOP(w))
+#define WSCRATCH(w)	((void *) (WSTACKTOP(w) + (1 + FSBULK_PAGES) * PGSIZE))
+#define WREPLY(w)	((void *) (WSTACKTOP(w) + (2 + FSBULK_PAGES) * PGSIZE))
+
+void worker_switch(uint32_t *save_esp, uint32_t esp);
+
+// Drop the npages pages mapped from va on.  Reserving over a run of
+// pages unmaps them all with one system call; the reservations cost
+// nothing until they are touched, and the next IPC maps over them.
+static void
+worker_drop(void *va, size_t npages)
+{
+	int r;
+
+	if ((r = sys_page_reserve(0, va, npages * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("worker_drop: %e", r);
+}
+
+// Serve requests as they are handed to us, forever.
+static void
+worker_main(void)
+{
+	struct worker *w = curworker;
+
+	while (1) {
+		serve_request(w->w_whom, w->w_req, WREQ(w), w->w_perm, w->w_npages);
+		if (w->w_npages > 1)
+			worker_drop(WREQ(w), w->w_npages);
+		else
+			sys_page_unmap(0, WREQ(w));
+		if (w->w_replied)
+			worker_drop(WREPLY(w), FSBULK_PAGES);
+		w->w_replied = 0;
+		w->w_busy = 0;
+		worker_woken = 1;
+		worker_switch(&w->w_esp, main_esp);
+	}
+}
+
+void
+worker_init(void)
+{
+	struct worker *w;
+	uint32_t *esp;
+	int r;
+
+	static_assert((1 + WORKER_STKPAGES + 2 + 2 * FSBULK_PAGES) * PGSIZE <= WORKER_SLOT);
+	for (w = workers; w < workers + NWORKERS; w++) {
+		if ((r = sys_page_reserve(0, (void *) WSLOT(w) + PGSIZE,
+					  WORKER_STKPAGES * PGSIZE,
+					  PTE_P|PTE_U|PTE_W)) < 0)
+			panic("worker_init: %e", r);
+		if ((r = sys_page_alloc(0, WSCRATCH(w), PTE_P|PTE_U|PTE_W)) < 0)
+			panic("worker_init: %e", r);
+
+		// Start out as if switched out right before worker_main,
+		// with its return address 0 to end backtraces
+		esp = (uint32_t *) WSTACKTOP(w);
+		*--esp = 0;
+		*--esp = (uint32_t) worker_main;
+		esp -= 4;		// %ebp, %ebx, %esi, %edi
+		w->w_esp = (uint32_t) esp;
+	}
+}
+
+// Return the page to receive the next request into: the request page
+// of an idle worker, or NULL if every worker is busy.
+union Fsipc *
+worker_next(void)
+{
+	struct worker *w;
+
+	for (w = workers; w < workers + NWORKERS; w++)
+		if (!w->w_busy)
+			return WREQ(w);
+	return NULL;
+}
+
+// Have the worker that owns the request page ipc serve the request
+// received into it, then run workers until they all wait.
+void
+worker_start(union Fsipc *ipc, envid_t whom, uint32_t req, int perm,
+	     size_t npages)
+{
+	struct worker *w = &workers[((uintptr_t) ipc - WORKERVA) / WORKER_SLOT];
+
+	assert(WREQ(w) == ipc && !w->w_busy);
+	w->w_busy = 1;
+	w->w_whom = whom;
+	w->w_req = req;
+	w->w_perm = perm;
+	w->w_npages = npages;
+	worker_woken = 1;
+	worker_run();
+}
+
+// Give each busy worker a turn, over and over while that lets them get
+// further: a waiting worker resumes where it left off, and waits again
+// if what it wants has not come yet.
+void
+worker_run(void)
+{
+	struct worker *w;
+
+	assert(!curworker);
+	while (worker_woken) {
+		worker_woken = 0;
+		bc_poll();
+		for (w = workers; w < workers + NWORKERS; w++) {
+			if (!w->w_busy)
+				continue;
+			curworker = w;
+			worker_switch(&main_esp, w->w_esp);
+			curworker = NULL;
+		}
+	}
+}
+
+// Are we running in a worker?
+bool
+worker_self(void)
+{
+	return curworker != NULL;
+}
+
+// Let the other workers run until something happens that may be what
+// this one is waiting for.
+void
+worker_wait(void)
+{
+	struct worker *w = curworker;
+
+	assert(w);
+	worker_switch(&w->w_esp, main_esp);
+}
+
+// Note that something a waiting worker may want has happened.
+void
+worker_wakeup(void)
+{
+	worker_woken = 1;
+}
+
+// A page the request being served may use to build its reply in.
+void *
+worker_scratch(void)
+{
+	assert(curworker);
+	return WSCRATCH(curworker);
+}
+
+// FSBULK_PAGES of address space, at first unmapped, where the request
+// being served may gather the pages it answers with.
+void *
+worker_reply(void)
+{
+	assert(curworker);
+	curworker->w_replied = 1;
+	return WREPLY(curworker);
+}
+
+// Take lock l, waiting while another worker holds it.  Outside the
+// workers there is no one to wait for, so this and the other locking
+// functions do nothing there.
+void
+fslock_acquire(struct fslock *l)
+{
+	if (!curworker)
+		return;
+	assert(l->l_owner != curworker);
+	while (l->l_owner)
+		worker_wait();
+	l->l_owner = curworker;
+}
+
+void
+fslock_release(struct fslock *l)
+{
+	if (!curworker)
+		return;
+	assert(l->l_owner == curworker);
+	l->l_owner = NULL;
+	worker_woken = 1;
+}
+
+bool
+fslock_held(struct fslock *l)
+{
+	return l->l_owner != NULL;
+}
+
+// Lock f, waiting while another worker has it locked.
+void
+file_lock(struct File *f)
+{
+	struct filelock *fl, *slot;
+
+	if (!curworker)
+		return;
+	while (1) {
+		slot = NULL;
+		for (fl = filelocks; fl < filelocks + ARRAY_SIZE(filelocks); fl++)
+			if (fl->fl_file == f)
+				break;
+			else if (!fl->fl_file && !slot)
+				slot = fl;
+		if (fl == filelocks + ARRAY_SIZE(filelocks))
+			break;
+		assert(fl->fl_owner != curworker);
+		worker_wait();
+	}
+	assert(slot);
+	slot->fl_file = f;
+	slot->fl_owner = curworker;
+}
+
+void
+file_unlock(struct File *f)
+{
+	struct filelock *fl;
+
+	if (!curworker)
+		return;
+	for (fl = filelocks; fl < filelocks + ARRAY_SIZE(filelocks); fl++)
+		if (fl->fl_file == f) {
+			assert(fl->fl_owner == curworker);
+			fl->fl_file = NULL;
+			worker_woken = 1;
+			return;
+		}
+	panic("file_unlock: %08x is not locked", f);
+}
@@ -45,6 +45,16 @@ enum EnvType {
 	ENV_TYPE_NS,		// Network server
 };
 
+// Resources used by an environment, counted by the kernel.
+struct Rusage {
+	uint32_t ru_resident;		// Physical pages mapped below UTOP
+	uint32_t ru_maxresident;	// Largest ru_resident has been
+	uint32_t ru_dzfaults;		// Demand-zero pages filled in
+	uint32_t ru_upcalls;		// Page faults passed to the user handler
+	uint32_t ru_syscalls;		// System calls made
+	uint32_t ru_ticks;		// Timer interrupts taken while running
+};
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -54,6 +64,7 @@ struct Env {
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
+	struct Rusage env_rusage;	// Resource usage
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
@@ -67,6 +78,8 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	uint32_t env_ipc_npages;	// Pages to receive at dstva, then received
+	uint32_t env_irq_pending;	// IRQs to report at the next ipc_recv
 };
 
 #endif // !JOS_INC_ENV_H
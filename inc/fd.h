@@ -11,6 +11,7 @@
 struct Fd;
 struct Stat;
 struct Dev;
+struct Dir;
 
 // Per-device-class file descriptor operations
 struct Dev {
@@ -25,6 +26,10 @@ struct Dev {
 
 struct FdFile {
 	int id;
+	// Bumped by the file server whenever the file is written or
+	// resized through any open, or a file is created in it if it is a
+	// directory, so cached pages of it can be checked
+	uint32_t gen;
 };
 
 struct FdSock {
@@ -24,23 +24,95 @@
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// Largest file in the block-pointer layout
+#define MAXBLKPTRSIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// Largest file in the extent layout: whatever off_t can address
+#define MAXFILESIZE	0x7FFFF000
+
+// A run of e_len blocks of a file, starting at file block e_fbno, kept
+// in the e_len disk blocks starting at e_start.  In an extent index,
+// e_start is instead an extent block holding the file's extents from
+// e_fbno on, and e_len is unused.
+struct Extent {
+	uint32_t e_fbno;
+	uint32_t e_start;
+	uint32_t e_len;
+} __attribute__((packed));
+
+// Extents a File holds itself
+#define NFILEEXTENT	9
+
+// An extent block, holding up to NBLKEXTENT extents sorted by e_fbno
+#define NBLKEXTENT	((BLKSIZE - 4) / sizeof(struct Extent))
+
+struct ExtentBlock {
+	uint32_t eb_nextent;
+	struct Extent eb_extent[NBLKEXTENT];
+} __attribute__((packed));
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
 	off_t f_size;			// file size in bytes
 	uint32_t f_type;		// file type
 
-	// Block pointers.
-	// A block is allocated iff its value is != 0.
-	uint32_t f_direct[NDIRECT];	// direct blocks
-	uint32_t f_indirect;		// indirect block
+	union {
+		// Block pointers, unless FFLAG_EXTENTS is set.
+		// A block is allocated iff its value is != 0.
+		struct {
+			uint32_t f_direct[NDIRECT];	// direct blocks
+			uint32_t f_indirect;		// indirect block
+		} __attribute__((packed));
 
-	// Pad out to 256 bytes; must do arithmetic in case we're compiling
-	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+		// Extents, if FFLAG_EXTENTS is set: with f_depth 0, up to
+		// NFILEEXTENT extents sorted by e_fbno; with f_depth 1, an
+		// index of up to NFILEEXTENT extent blocks.
+		struct {
+			uint16_t f_nextent;
+			uint16_t f_depth;
+			struct Extent f_extent[NFILEEXTENT];
+		} __attribute__((packed));
+	};
+	uint32_t f_flags;		// FFLAG_*
+	uint32_t f_dirindex;		// DirIndex block, if FFLAG_DIRINDEX
+
+	// The fields above fill 256 bytes exactly; the size must come out
+	// the same when compiling fsformat on a 64-bit machine.
 } __attribute__((packed));	// required only on some 64-bit machines
 
+// File flags
+#define FFLAG_EXTENTS	0x1	// Blocks are kept in extents
+#define FFLAG_DIRINDEX	0x2	// Directory has a hash index
+
+// A directory's hash index: an open-addressing hash table of
+// di_nslots slots (a power of two), DIRSLOTS to each of the blocks
+// listed in di_blocks.  A slot holds 0 if it is empty, or the number
+// of a directory entry plus one, with the top DIRTAGBITS bits of the
+// name's hash above it so most mismatches need not look at the entry.
+#define DIRSLOTS	(BLKSIZE / 4)
+#define DIRENTBITS	23
+#define DIRTAGBITS	(32 - DIRENTBITS)
+#define DIRSLOT(hash, ent) \
+	((((hash) >> DIRENTBITS) << DIRENTBITS) | ((ent) + 1))
+#define DIRSLOT_ENT(slot)	(((slot) & ((1 << DIRENTBITS) - 1)) - 1)
+#define DIRSLOT_TAG(slot)	((slot) >> DIRENTBITS)
+
+struct DirIndex {
+	uint32_t di_nslots;		// Slots in the table
+	uint32_t di_nentries;		// Entries in use
+	uint32_t di_blocks[(BLKSIZE - 8) / 4];
+};
+
+// The hash of a directory entry's name (FNV-1a)
+static inline uint32_t
+dirhash(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619;
+	return h;
+}
+
 // An inode block contains exactly BLKFILES 'struct File's
 #define BLKFILES	(BLKSIZE / sizeof(struct File))
 
@@ -57,6 +129,28 @@ struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_features;		// FS_FEAT_*
+	uint32_t s_journal;		// First journal block, if FS_FEAT_JOURNAL
+	uint32_t s_njournal;		// Journal blocks
+};
+
+// File system features
+#define FS_FEAT_EXTENTS	0x1	// New files are created with extents
+#define FS_FEAT_DIRINDEX 0x2	// Large directories get hash indexes
+#define FS_FEAT_JOURNAL	0x4	// Metadata changes go through a journal
+
+// The journal: a header block, then copies of the blocks of the last
+// transaction committed, in order.  jh_n is 0 once they have all been
+// written where they belong.  The header fits in one 512-byte sector,
+// so it is written all or nothing.
+#define JOURNAL_MAGIC		0x4A4C4F47	// 'JLOG'
+#define JOURNAL_MAXBLOCKS	((512 - 12) / 4)
+
+struct JournalHeader {
+	uint32_t jh_magic;		// JOURNAL_MAGIC
+	uint32_t jh_seq;		// Transactions committed before this one
+	uint32_t jh_n;			// Blocks in it, or 0 if none to replay
+	uint32_t jh_blocks[JOURNAL_MAXBLOCKS];	// Where each one belongs
 };
 
 // Definitions for requests from clients to file system
@@ -70,7 +164,92 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Map returns the block-cache page itself, read-only
+	FSREQ_MAP,
+	// Stats returns a Fsstats on the request page
+	FSREQ_STATS,
+	// Ring keeps the page sent as the caller's completion ring
+	FSREQ_RING,
+	// Bulk read returns the pages holding the data, and a
+	// Fsret_read_pages on the request page
+	FSREQ_READ_PAGES,
+	// Bulk write takes the data in the pages after the request page
+	FSREQ_WRITE_PAGES,
+	// Readdir returns packed Fsdirents on the request page
+	FSREQ_READDIR
+};
+
+// A bulk read or write moves up to FSBULK_PAGES pages of data with one
+// IPC.  A bulk write sends the data in the pages following the request
+// page.  A bulk read is answered with the pages of the blocks that hold
+// the data, read-only; the data starts ret_offset % BLKSIZE bytes into
+// the first one.
+#define FSBULK_PAGES	64
+
+// FSREQ_READDIR packs as many of the directory's files as fit into
+// readdirRet.ret_buf, one after another, each a struct Fsdirent
+// followed by its null-terminated name and padded to d_reclen bytes.
+struct Fsdirent {
+	off_t d_size;
+	uint16_t d_reclen;		// bytes to the next entry
+	uint8_t d_type;			// FTYPE_*
+	char d_name[];
+};
+
+// A request with FSREQ_ASYNC set in its IPC value is answered by
+// posting its tag and result to the caller's completion ring instead
+// of with an IPC, so a client can have several requests in flight.
+// The value carries the request code in its low byte and the tag
+// above it.  Open and map, which answer with a page, cannot be sent
+// this way.
+#define FSREQ_ASYNC		0x80000000
+#define FSREQ_MKASYNC(code, tag)	(FSREQ_ASYNC | ((tag) << 8) | (code))
+#define FSREQ_CODE(v)		((v) & 0xFF)
+#define FSREQ_TAG(v)		(((v) & ~FSREQ_ASYNC) >> 8)
+
+// A client's completion ring.  The file server adds completions at
+// r_tail and the client takes them from r_head.  A client has at most
+// FSRING_SIZE requests outstanding, so the ring never overflows.  A
+// client that sets r_waiting is sent an IPC by whoever clears it.
+#define FSRING_SIZE	32
+
+struct Fscomp {
+	uint32_t c_tag;
+	int32_t c_result;
+};
+
+struct Fsring {
+	volatile uint32_t r_head;
+	volatile uint32_t r_tail;
+	volatile uint32_t r_waiting;
+	volatile struct Fscomp r_comp[FSRING_SIZE];
+};
+
+// File server counters
+struct Fsstats {
+	uint32_t bc_limit;		// Most blocks the block cache holds
+	uint32_t bc_resident;		// Blocks it holds now
+	uint32_t bc_hits;		// File blocks found already in memory
+	uint32_t bc_misses;		// Blocks read in from disk
+	uint32_t bc_readahead;		// Blocks read in before they were used
+	uint32_t bc_evictions;		// Blocks dropped to make room
+	uint32_t bc_writebacks;		// Dirty blocks written to disk
+	uint32_t bc_dirty;		// Dirty blocks after the last flush
+	uint32_t bc_flushes;		// Background writebacks
+	uint32_t dc_hits;		// Path lookups answered by the cache
+	uint32_t dc_misses;		// Path lookups that searched a directory
+	uint32_t wk_waits;		// Requests that waited for the disk
+	uint32_t of_inuse;		// Open files, as of the last sweep
+	uint32_t of_opens;		// Files opened
+	uint32_t of_closes;		// Closed files found by sweeps
+	uint32_t tf_blocks;		// Blocks the tmpfs holds
+	uint32_t tf_limit;		// Most blocks it may hold
+	uint32_t jn_commits;		// Journal transactions committed
+	uint32_t jn_blocks;		// Blocks they held
+	uint32_t jn_replayed;		// Blocks replayed at startup
+	uint32_t ide_requests;		// Transfers asked of the disk driver
+	uint32_t ide_commands;		// DMA commands they took
 };
 
 union Fsipc {
@@ -108,6 +287,24 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+	} map;
+	struct Fsret_read_pages {
+		off_t ret_offset;
+	} readPagesRet;
+	struct Fsreq_write_pages {
+		int req_fileid;
+		size_t req_n;
+	} writePages;
+	struct Fsreq_readdir {
+		int req_fileid;
+	} readdir;
+	struct Fsret_readdir {
+		char ret_buf[PGSIZE];
+	} readdirRet;
+	struct Fsstats statsRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
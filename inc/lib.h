@@ -57,8 +57,16 @@ int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_reserve(envid_t env, void *va, size_t len, int perm);
+int	sys_env_getrusage(envid_t env, struct Rusage *ru);
+int	sys_page_phys(void *va);
+int	sys_ide_bmbase(void);
+int	sys_irq_listen(int irq);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_try_send_pages(envid_t to_env, uint32_t value, void *pg,
+			       size_t npages, int perm);
+int	sys_ipc_recv_pages(void *rcv_pg, size_t npages);
 unsigned int sys_time_msec(void);
 int sys_tx_packet(void *buf, int size);
 int sys_rx_packet(void *buf);
@@ -77,12 +85,18 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+void	ipc_send_pages(envid_t to_env, uint32_t value, void *pg, size_t npages, int perm);
+int32_t ipc_recv_pages(envid_t *from_env_store, void *pg, size_t *npages, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
 #define	PTE_SHARE	0x400
+// PTE_COW marks copy-on-write page table entries.
+// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
+#define	PTE_COW		0x800
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
+void	cow_pgfault(struct UTrapframe *utf);
 
 // fd.c
 int	close(int fd);
@@ -100,6 +114,18 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	fsstats(struct Fsstats *st);
+int	opendir(const char *path, struct Dir **dp);
+int	readdir(struct Dir *d, struct Stat *st);
+void	closedir(struct Dir *d);
+int	mmap(void *va, size_t len, int perm, int fd, off_t offset);
+int	munmap(void *va, size_t len);
+ssize_t	sendfile(int s, int fd, off_t offset, size_t len);
+int	aio_read(int fd, void *buf, size_t n, uint32_t tag);
+int	aio_write(int fd, const void *buf, size_t n, uint32_t tag);
+int	aio_stat(int fd, struct Stat *st, uint32_t tag);
+int	aio_poll(uint32_t *tag, int *result);
+int	aio_wait(uint32_t *tag, int *result);
 
 // pageref.c
 int	pageref(void *addr);
@@ -121,6 +147,7 @@ int     nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen);
 int     nsipc_listen(int s, int backlog);
 int     nsipc_recv(int s, void *mem, int len, unsigned int flags);
 int     nsipc_send(int s, const void *buf, int size, unsigned int flags);
+int     nsipc_sendpages(int s, void *pg, int npages, int offset, int size, bool more);
 int     nsipc_socket(int domain, int type, int protocol);
 
 // spawn.c
@@ -175,6 +175,8 @@ extern volatile pde_t uvpd[];     // VA of current page directory
  * You can map a struct PageInfo * to the corresponding physical address
  * with page2pa() in kern/pmap.h.
  */
+struct Env;
+
 struct PageInfo {
 	// Next page on the free list.
 	struct PageInfo *pp_link;
@@ -185,6 +187,10 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// For a page directory, the environment whose address space it
+	// is; NULL for every other page.
+	struct Env *pp_env;
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -72,6 +72,12 @@
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
+// A PTE with PTE_P clear but PTE_DZ set is a demand-zero reservation
+// (see sys_page_reserve).  The hardware ignores every other bit of a
+// non-present entry, so the kernel keeps the permissions the page will
+// get when it is first touched in the low bits, just as for a mapping.
+#define PTE_DZ		0x100
+
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
 
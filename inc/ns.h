@@ -26,6 +26,8 @@ enum {
 	NSREQ_RECV,
 	NSREQ_SEND,
 	NSREQ_SOCKET,
+	// Sendpages sends data in the pages that follow the request page.
+	NSREQ_SENDPAGES,
 
 	// The following two messages pass a page containing a struct jif_pkt
 	NSREQ_INPUT,
@@ -37,6 +39,9 @@ enum {
 	NSREQ_TIMER,
 };
 
+// Most pages of data an NSREQ_SENDPAGES can carry
+#define NSBULK_PAGES	16
+
 // Definitions of responses to IPC messeges
 enum {
 	NRES_OK = 0,
@@ -98,6 +103,18 @@ union Nsipc {
 		char req_buf[0];
 	} send;
 
+	// The data starts req_offset bytes into the page after this one.
+	// The network server sends it from those pages as they are, and
+	// keeps them until the peer has acknowledged all of it.  It
+	// answers once the data is queued and what went before it is
+	// acknowledged, or, without req_more, once all of it is.
+	struct Nsreq_sendpages {
+		int req_s;
+		int req_offset;
+		int req_size;
+		int req_more;
+	} sendPages;
+
 	struct Nsreq_socket {
 		int req_domain;
 		int req_type;
@@ -20,6 +20,13 @@ enum {
 	SYS_time_msec,
 	SYS_tx_packet,
 	SYS_rx_packet,
+	SYS_page_reserve,
+	SYS_env_getrusage,
+	SYS_page_phys,
+	SYS_ide_bmbase,
+	SYS_irq_listen,
+	SYS_ipc_try_send_pages,
+	SYS_ipc_recv_pages,
 	NSYSCALLS
 };
 
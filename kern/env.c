@@ -189,6 +189,7 @@ env_setup_vm(struct Env *e)
 	pde_t *env_pgdir = page2kva(p);
 	memcpy(env_pgdir, kern_pgdir, PGSIZE);
 	p->pp_ref++;
+	p->pp_env = e;
 	e->env_pgdir = env_pgdir;
 
 	// UVPT maps the env's own page table read-only.
@@ -231,6 +232,8 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_type = ENV_TYPE_USER;
 	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	memset(&e->env_rusage, 0, sizeof(e->env_rusage));
+	e->env_irq_pending = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -305,6 +308,32 @@ region_alloc(struct Env *e, void *va, size_t len)
 	}
 }
 
+//
+// Reserve [va, va+len) in environment env as demand-zero memory,
+// writable by user and kernel.  Nothing is allocated until the env
+// touches a page.  Like region_alloc, 'va' and 'len' need not be
+// page-aligned.  Pages already mapped, such as the last page of the
+// segment before a bss-only one, are left as they are.
+// Panic if a page table cannot be allocated.
+//
+static void
+region_reserve(struct Env *e, void *va, size_t len)
+{
+	if (len == 0) {
+		return;
+	}
+
+	uintptr_t hi_addr = ROUNDUP((uintptr_t)va + len, PGSIZE);
+	uintptr_t lo_addr = ROUNDDOWN((uintptr_t)va, PGSIZE);
+	for (; lo_addr < hi_addr; lo_addr += PGSIZE) {
+		if (page_lookup(e->env_pgdir, (void *)lo_addr, NULL))
+			continue;
+		if (page_reserve(e->env_pgdir, (void *)lo_addr, PTE_W | PTE_U) < 0) {
+			panic("failed to reserve page. env addr: %x\n", e);
+		}
+	}
+}
+
 //
 // Set up the initial program binary, stack, and processor flags
 // for a user process.
@@ -372,15 +401,23 @@ load_icode(struct Env *e, uint8_t *binary)
 		if (header->p_type != ELF_PROG_LOAD) {
 			continue;
 		}
-		region_alloc(e, (void *)header->p_va, header->p_memsz);
-		memset((void*)header->p_va, 0, header->p_memsz);
-		void *foffset = (void *)(binary + header->p_offset);
-		memcpy((void *)header->p_va, foffset, header->p_filesz);
+		// Only the pages holding file data are allocated now; the
+		// rest of the segment is bss and is left demand-zero.
+		uintptr_t va = header->p_va;
+		uintptr_t bss = ROUNDDOWN(va, PGSIZE);
+		if (header->p_filesz > 0) {
+			bss = ROUNDUP(va + header->p_filesz, PGSIZE);
+			region_alloc(e, (void *)va, header->p_filesz);
+			memset((void *)va, 0, bss - va);
+			void *foffset = (void *)(binary + header->p_offset);
+			memcpy((void *)va, foffset, header->p_filesz);
+		}
+		if (va + header->p_memsz > bss)
+			region_reserve(e, (void *)bss, va + header->p_memsz - bss);
 	}
 
-	// Now map one page for the program's initial stack
-	region_alloc(e, (void *)(USTACKTOP - PGSIZE), PGSIZE);
-	memset((void *)(USTACKTOP - PGSIZE), 0, PGSIZE);
+	// Now reserve one page for the program's initial stack
+	region_reserve(e, (void *)(USTACKTOP - PGSIZE), PGSIZE);
 
 	// switch back to kern_pgdir to be on the safe side
 	lcr3(PADDR(kern_pgdir));
@@ -467,6 +504,7 @@ env_free(struct Env *e)
 	// free the page directory
 	pa = PADDR(e->env_pgdir);
 	e->env_pgdir = 0;
+	pa2page(pa)->pp_env = NULL;
 	page_decref(pa2page(pa));
 
 	// return the environment to the free list
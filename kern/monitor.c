@@ -12,6 +12,7 @@
 #include <kern/kdebug.h>
 #include <kern/pmap.h>
 #include <kern/trap.h>
+#include <kern/slab.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -28,7 +29,8 @@ static struct Command commands[] = {
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
 	{ "backtrace", "Display the backtrace on the stack", mon_backtrace },
 	{ "vaddrinfo", "Display information about virtual address", mon_vaddrinfo },
-	{ "pgdir", "Display the contents of a page directory or a page table", mon_pgdir }
+	{ "pgdir", "Display the contents of a page directory or a page table", mon_pgdir },
+	{ "kmem", "Display kernel object cache statistics", mon_kmem }
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -218,6 +220,13 @@ mon_pgdir(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_kmem(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_print_stats();
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
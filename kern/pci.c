@@ -13,8 +13,13 @@ static int pci_show_addrs = 0;
 static uint32_t pci_conf1_addr_ioport = 0x0cf8;
 static uint32_t pci_conf1_data_ioport = 0x0cfc;
 
+// I/O port base of the bus-master IDE DMA registers, or 0 if there is
+// no bus-master IDE controller
+uint32_t pci_ide_bmbase;
+
 // Forward declarations
 static int pci_bridge_attach(struct pci_func *pcif);
+static int pci_ide_attach(struct pci_func *pcif);
 
 // PCI driver table
 struct pci_driver {
@@ -25,6 +30,7 @@ struct pci_driver {
 // pci_attach_class matches the class and subclass of a PCI device
 struct pci_driver pci_attach_class[] = {
 	{ PCI_CLASS_BRIDGE, PCI_SUBCLASS_BRIDGE_PCI, &pci_bridge_attach },
+	{ PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_MASS_STORAGE_IDE, &pci_ide_attach },
 	{ 0, 0, 0 },
 };
 
@@ -188,6 +194,23 @@ pci_bridge_attach(struct pci_func *pcif)
 	return 1;
 }
 
+// The file system server drives the disk itself; all we do for it is
+// enable the IDE controller and note where its bus-master registers are.
+static int
+pci_ide_attach(struct pci_func *pcif)
+{
+	pci_func_enable(pcif);
+
+	// Bit 7 of the programming interface: controller can bus master
+	if (!(PCI_INTERFACE(pcif->dev_class) & 0x80))
+		return 0;
+
+	pci_ide_bmbase = pcif->reg_base[4];
+	cprintf("PCI: %02x:%02x.%d: IDE bus master registers at port 0x%x\n",
+		pcif->bus->busno, pcif->dev, pcif->func, pci_ide_bmbase);
+	return 1;
+}
+
 // External PCI subsystem interface
 
 void
@@ -92,6 +92,7 @@ irq_eoi(void)
 	//   s: specific
 	//   e: end-of-interrupt
 	// xxx: specific interrupt line
-	outb(IO_PIC1, 0x20);
+	// The slave first, since it raised the master's IRQ_SLAVE
 	outb(IO_PIC2, 0x20);
+	outb(IO_PIC1, 0x20);
 }
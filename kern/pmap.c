@@ -486,6 +486,30 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 	}
 }
 
+//
+// Return the environment whose address space is 'pgdir', or NULL if it
+// is not an environment's (e.g. kern_pgdir).  env_setup_vm records the
+// owner in the page directory's PageInfo.
+//
+static struct Env *
+pgdir_env(pde_t *pgdir)
+{
+	return pa2page(PADDR(pgdir))->pp_env;
+}
+
+// Count a page mapped into (delta 1) or out of (delta -1) 'pgdir'.
+static void
+resident_adjust(pde_t *pgdir, int delta)
+{
+	struct Env *e;
+
+	if (!(e = pgdir_env(pgdir)))
+		return;
+	e->env_rusage.ru_resident += delta;
+	if (e->env_rusage.ru_resident > e->env_rusage.ru_maxresident)
+		e->env_rusage.ru_maxresident = e->env_rusage.ru_resident;
+}
+
 //
 // Map the physical page 'pp' at virtual address 'va'.
 // The permissions (the low 12 bits) of the page table entry
@@ -542,6 +566,7 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	// Map
 	pp->pp_ref++;
 	*pte = page2pa(pp) | perm | PTE_P;
+	resident_adjust(pgdir, 1);
 
 	return 0;
 }
@@ -605,9 +630,70 @@ page_remove(pde_t *pgdir, void *va)
 		*pte_store = 0;
 		page_decref(p);
 		tlb_invalidate(pgdir, va);
+		resident_adjust(pgdir, -1);
+	}
+	else if ((pte_store = pgdir_walk(pgdir, va, false)) && (*pte_store & PTE_DZ))
+	{
+		// Drop a demand-zero reservation that was never touched
+		*pte_store = 0;
 	}
 }
 
+//
+// Reserve the page at virtual address 'va' as demand-zero.
+// No physical page is allocated; the PTE is left non-present with PTE_DZ
+// set and 'perm' recorded, and page_demand_fill maps a zeroed page there
+// the first time the page is touched.
+// Any page already mapped at 'va' is page_remove()d.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if page table couldn't be allocated
+//
+int
+page_reserve(pde_t *pgdir, void *va, int perm)
+{
+	pte_t *pte = pgdir_walk(pgdir, va, true);
+
+	if (!pte)
+		return -E_NO_MEM;
+
+	if (*pte & PTE_P)
+		page_remove(pgdir, va);
+
+	*pte = PTE_DZ | (perm & ~PTE_P);
+	return 0;
+}
+
+//
+// If 'va' is a demand-zero reservation, allocate a zeroed page and map
+// it there with the reserved permissions.
+//
+// RETURNS:
+//   1 if a page was mapped
+//   0 if 'va' is not a demand-zero reservation (nothing is done)
+//   -E_NO_MEM, if there is no free page
+//
+int
+page_demand_fill(pde_t *pgdir, void *va)
+{
+	pte_t *pte = pgdir_walk(pgdir, va, false);
+	struct PageInfo *p = NULL;
+	struct Env *e;
+
+	if (!pte || (*pte & PTE_P) || !(*pte & PTE_DZ))
+		return 0;
+
+	if (!(p = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+
+	// The page table already exists, so this cannot fail
+	page_insert(pgdir, p, ROUNDDOWN(va, PGSIZE), *pte & PTE_SYSCALL);
+	if ((e = pgdir_env(pgdir)))
+		e->env_rusage.ru_dzfaults++;
+	return 1;
+}
+
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
@@ -706,7 +792,13 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 
 		pte = pgdir_walk(env->env_pgdir, (void *)user_mem_check_addr, 0);
 
-		if ((*pte & perm) != perm)
+		// A page the env has only reserved will be present once
+		// filled in, with the permissions it was reserved with
+		if (!pte || ((*pte | (*pte & PTE_DZ ? PTE_P : 0)) & perm) != perm)
+			return -E_FAULT;
+
+		// The kernel is about to touch it
+		if (page_demand_fill(env->env_pgdir, (void *)user_mem_check_addr) < 0)
 			return -E_FAULT;
 	}
 
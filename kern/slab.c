@@ -0,0 +1,363 @@
+// Slab allocator for kernel objects.
+//
+// An object cache (struct kmem_cache) carves pages from the page allocator
+// into equal-sized, aligned objects.  Each slab is one page: a struct
+// kmem_slab header at the start of the page, then the objects.  Free
+// objects in a slab are chained through a link word placed just after
+// each object, so an object's own bytes survive being freed.
+//
+// Objects are constructed once, when their slab is created, and must be
+// handed back to kmem_cache_free in their constructed state.
+//
+// In front of the slabs each CPU keeps a small array of free objects.
+// kmem_cache_alloc and kmem_cache_free only touch the current CPU's
+// array unless it is empty or full; only then do they take the cache's
+// lock and move KMEM_BATCH objects to or from the slabs.
+
+#include <inc/assert.h>
+#include <inc/string.h>
+
+#include <kern/pmap.h>
+#include <kern/slab.h>
+
+// Slab header, at the start of the slab's page.
+struct kmem_slab {
+	struct kmem_slab *sl_next;	// Next slab on the cache's list
+	struct kmem_slab **sl_pprev;	// Link pointing at us
+	struct kmem_cache *sl_cache;	// Owning cache
+	void *sl_free;			// First free object
+	uint32_t sl_inuse;		// Objects not on sl_free
+};
+
+// The free-list link word of object 'obj' in cache 'cp'
+#define OBJ_LINK(cp, obj)	(*(void **) ((char *) (obj) + (cp)->cp_linkoff))
+
+// Caches are themselves allocated from this one
+static struct kmem_cache kmem_cache_cache;
+
+// All caches, for kmem_print_stats
+static struct kmem_cache *kmem_caches;
+
+static void check_kmem(void);
+
+static void
+slab_list_insert(struct kmem_slab **head, struct kmem_slab *sl)
+{
+	if ((sl->sl_next = *head))
+		(*head)->sl_pprev = &sl->sl_next;
+	*head = sl;
+	sl->sl_pprev = head;
+}
+
+static void
+slab_list_remove(struct kmem_slab *sl)
+{
+	if (sl->sl_next)
+		sl->sl_next->sl_pprev = sl->sl_pprev;
+	*sl->sl_pprev = sl->sl_next;
+	sl->sl_next = NULL;
+	sl->sl_pprev = NULL;
+}
+
+// Work out the slab layout for a cache and put it on kmem_caches.
+static void
+cache_setup(struct kmem_cache *cp, const char *name, size_t size,
+	    size_t align, void (*ctor)(void *obj))
+{
+	if (align == 0)
+		align = sizeof(void *);
+	if (align & (align - 1))
+		panic("kmem_cache_create %s: alignment %d is not a power of 2",
+		      name, align);
+
+	memset(cp, 0, sizeof(*cp));
+	__spin_initlock(&cp->cp_lock, (char *) name);
+	cp->cp_name = name;
+	cp->cp_size = size;
+	cp->cp_linkoff = ROUNDUP(size, sizeof(void *));
+	cp->cp_stride = ROUNDUP(cp->cp_linkoff + sizeof(void *), align);
+	cp->cp_first = ROUNDUP(sizeof(struct kmem_slab), align);
+	if (cp->cp_first + cp->cp_stride > PGSIZE)
+		panic("kmem_cache_create %s: %d-byte objects do not fit in a slab",
+		      name, size);
+	cp->cp_perslab = (PGSIZE - cp->cp_first) / cp->cp_stride;
+	cp->cp_ctor = ctor;
+
+	cp->cp_next = kmem_caches;
+	kmem_caches = cp;
+}
+
+// Add a freshly constructed slab to cp.  Called with cp_lock held.
+// Returns NULL if out of memory.
+static struct kmem_slab *
+slab_grow(struct kmem_cache *cp)
+{
+	struct PageInfo *pp;
+	struct kmem_slab *sl;
+	char *obj;
+	uint32_t i;
+
+	if (!(pp = page_alloc(0)))
+		return NULL;
+	pp->pp_ref++;
+
+	sl = page2kva(pp);
+	sl->sl_cache = cp;
+	sl->sl_free = NULL;
+	sl->sl_inuse = 0;
+
+	// Chain back to front so objects are handed out in address order
+	for (i = cp->cp_perslab; i-- > 0; ) {
+		obj = (char *) sl + cp->cp_first + i * cp->cp_stride;
+		if (cp->cp_ctor)
+			cp->cp_ctor(obj);
+		OBJ_LINK(cp, obj) = sl->sl_free;
+		sl->sl_free = obj;
+	}
+
+	slab_list_insert(&cp->cp_partial, sl);
+	cp->cp_nslabs++;
+	cp->cp_nempty++;
+	return sl;
+}
+
+// Give an empty slab's page back to the page allocator.
+// Called with cp_lock held.
+static void
+slab_release(struct kmem_cache *cp, struct kmem_slab *sl)
+{
+	assert(sl->sl_inuse == 0);
+	slab_list_remove(sl);
+	cp->cp_nslabs--;
+	cp->cp_nempty--;
+	page_decref(pa2page(PADDR(sl)));
+}
+
+// Take one object out of cp's slabs.  Called with cp_lock held.
+static void *
+slab_alloc_obj(struct kmem_cache *cp)
+{
+	struct kmem_slab *sl;
+	void *obj;
+
+	if (!(sl = cp->cp_partial) && !(sl = slab_grow(cp)))
+		return NULL;
+
+	obj = sl->sl_free;
+	sl->sl_free = OBJ_LINK(cp, obj);
+	if (sl->sl_inuse++ == 0)
+		cp->cp_nempty--;
+	if (!sl->sl_free) {
+		slab_list_remove(sl);
+		slab_list_insert(&cp->cp_full, sl);
+	}
+	cp->cp_allocs++;
+	return obj;
+}
+
+// Return one object to its slab.  Keeps one empty slab around so a
+// cache hovering at a slab boundary does not thrash the page allocator.
+// Called with cp_lock held.
+static void
+slab_free_obj(struct kmem_cache *cp, void *obj)
+{
+	struct kmem_slab *sl = ROUNDDOWN(obj, PGSIZE);
+
+	if (sl->sl_cache != cp)
+		panic("kmem_cache_free %s: %08x is not from this cache",
+		      cp->cp_name, obj);
+
+	if (!sl->sl_free) {
+		slab_list_remove(sl);
+		slab_list_insert(&cp->cp_partial, sl);
+	}
+	OBJ_LINK(cp, obj) = sl->sl_free;
+	sl->sl_free = obj;
+	cp->cp_frees++;
+
+	if (--sl->sl_inuse == 0 && ++cp->cp_nempty > 1)
+		slab_release(cp, sl);
+}
+
+// Move every object in cpu cache 'cc' back to the slabs.
+// Called with cp_lock held.
+static void
+cpu_cache_drain(struct kmem_cache *cp, struct kmem_cpu_cache *cc)
+{
+	while (cc->cc_avail > 0)
+		slab_free_obj(cp, cc->cc_objs[--cc->cc_avail]);
+}
+
+//
+// Create a cache of 'size'-byte objects aligned to 'align' bytes (a power
+// of 2, or 0 for word alignment).  If 'ctor' is not NULL it is called on
+// every object when its slab is created.
+// 'name' must stay valid for the life of the cache.
+//
+// Returns the new cache, or NULL if out of memory.
+// Panics if an object cannot fit in a one-page slab.
+//
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *obj))
+{
+	struct kmem_cache *cp;
+
+	if (!(cp = kmem_cache_alloc(&kmem_cache_cache)))
+		return NULL;
+	cache_setup(cp, name, size, align, ctor);
+	return cp;
+}
+
+//
+// Destroy cache 'cp' and give its pages back to the page allocator.
+// Every object must have been freed.
+//
+void
+kmem_cache_destroy(struct kmem_cache *cp)
+{
+	struct kmem_cache **pp;
+	int i;
+
+	spin_lock(&cp->cp_lock);
+	for (i = 0; i < NCPU; i++)
+		cpu_cache_drain(cp, &cp->cp_cpu[i]);
+	if (cp->cp_full || cp->cp_nempty != cp->cp_nslabs)
+		panic("kmem_cache_destroy %s: objects still in use", cp->cp_name);
+	while (cp->cp_partial)
+		slab_release(cp, cp->cp_partial);
+	spin_unlock(&cp->cp_lock);
+
+	for (pp = &kmem_caches; *pp != cp; pp = &(*pp)->cp_next)
+		/* do nothing */;
+	*pp = cp->cp_next;
+
+	kmem_cache_free(&kmem_cache_cache, cp);
+}
+
+//
+// Allocate a constructed object from cache 'cp'.
+// Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct kmem_cache *cp)
+{
+	struct kmem_cpu_cache *cc = &cp->cp_cpu[cpunum()];
+	void *obj;
+	int i;
+
+	// Fast path: no lock, just this CPU's array
+	if (cc->cc_avail > 0)
+		return cc->cc_objs[--cc->cc_avail];
+
+	spin_lock(&cp->cp_lock);
+	for (i = 0; i < KMEM_BATCH; i++) {
+		if (!(obj = slab_alloc_obj(cp)))
+			break;
+		cc->cc_objs[cc->cc_avail++] = obj;
+	}
+	spin_unlock(&cp->cp_lock);
+
+	if (cc->cc_avail == 0)
+		return NULL;
+	return cc->cc_objs[--cc->cc_avail];
+}
+
+//
+// Return object 'obj', in its constructed state, to cache 'cp'.
+//
+void
+kmem_cache_free(struct kmem_cache *cp, void *obj)
+{
+	struct kmem_cpu_cache *cc = &cp->cp_cpu[cpunum()];
+	int i;
+
+	if (cc->cc_avail == KMEM_CPU_CACHE) {
+		// Send the coldest half of the array back to the slabs
+		spin_lock(&cp->cp_lock);
+		for (i = 0; i < KMEM_BATCH; i++)
+			slab_free_obj(cp, cc->cc_objs[i]);
+		spin_unlock(&cp->cp_lock);
+		memmove(&cc->cc_objs[0], &cc->cc_objs[KMEM_BATCH],
+			(KMEM_CPU_CACHE - KMEM_BATCH) * sizeof(void *));
+		cc->cc_avail -= KMEM_BATCH;
+	}
+
+	cc->cc_objs[cc->cc_avail++] = obj;
+}
+
+void
+kmem_print_stats(void)
+{
+	struct kmem_cache *cp;
+
+	cprintf("cache            size  slabs  objects  allocs    frees\n");
+	for (cp = kmem_caches; cp; cp = cp->cp_next)
+		cprintf("%-16s %4d  %5d  %7d  %6d  %7d\n",
+			cp->cp_name, cp->cp_size, cp->cp_nslabs,
+			cp->cp_allocs - cp->cp_frees, cp->cp_allocs,
+			cp->cp_frees);
+}
+
+// Set up the cache of caches.  Must run after mem_init.
+void
+kmem_init(void)
+{
+	cache_setup(&kmem_cache_cache, "kmem_cache",
+		    sizeof(struct kmem_cache), KMEM_CACHE_LINE, NULL);
+	check_kmem();
+}
+
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+#define CHECK_MAGIC	0xC0FFEE
+
+static void
+check_ctor(void *obj)
+{
+	*(uint32_t *) obj = CHECK_MAGIC;
+}
+
+static void
+check_kmem(void)
+{
+	struct kmem_cache *cp;
+	void *objs[100];
+	int i, j;
+
+	cp = kmem_cache_create("check", 100, KMEM_CACHE_LINE, check_ctor);
+	assert(cp && cp->cp_perslab < ARRAY_SIZE(objs));
+
+	// Objects are distinct, aligned, constructed and span several slabs
+	for (i = 0; i < ARRAY_SIZE(objs); i++) {
+		objs[i] = kmem_cache_alloc(cp);
+		assert(objs[i] && (uintptr_t) objs[i] % KMEM_CACHE_LINE == 0);
+		assert(*(uint32_t *) objs[i] == CHECK_MAGIC);
+		for (j = 0; j < i; j++)
+			assert(objs[i] != objs[j]);
+	}
+	assert(cp->cp_nslabs >= ARRAY_SIZE(objs) / cp->cp_perslab);
+
+	// Freed objects come back from this CPU's array, most recent first
+	kmem_cache_free(cp, objs[0]);
+	kmem_cache_free(cp, objs[1]);
+	assert(kmem_cache_alloc(cp) == objs[1]);
+	assert(kmem_cache_alloc(cp) == objs[0]);
+
+	// Free everything: all but one empty slab go back to the page allocator
+	for (i = 0; i < ARRAY_SIZE(objs); i++)
+		kmem_cache_free(cp, objs[i]);
+	assert(cp->cp_cpu[cpunum()].cc_avail <= KMEM_CPU_CACHE);
+	for (i = 0; i < ARRAY_SIZE(objs); i++) {
+		objs[i] = kmem_cache_alloc(cp);
+		assert(*(uint32_t *) objs[i] == CHECK_MAGIC);
+	}
+	for (i = 0; i < ARRAY_SIZE(objs); i++)
+		kmem_cache_free(cp, objs[i]);
+
+	kmem_cache_destroy(cp);
+	cprintf("check_kmem() succeeded!\n");
+}
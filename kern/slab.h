@@ -0,0 +1,60 @@
+#ifndef JOS_KERN_SLAB_H
+#define JOS_KERN_SLAB_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+// Objects each CPU keeps in front of the slab layer, and how many move
+// between a CPU's array and the slabs at a time.
+#define KMEM_CPU_CACHE	16
+#define KMEM_BATCH	(KMEM_CPU_CACHE / 2)
+
+// Align objects (and per-CPU arrays) to this to keep them off each
+// other's cache lines.
+#define KMEM_CACHE_LINE	64
+
+struct kmem_slab;
+
+// Per-CPU array of free, constructed objects.
+struct kmem_cpu_cache {
+	int cc_avail;				// Objects in cc_objs
+	void *cc_objs[KMEM_CPU_CACHE];
+} __attribute__((aligned(KMEM_CACHE_LINE)));
+
+struct kmem_cache {
+	struct kmem_cpu_cache cp_cpu[NCPU];	// Lock-free per-CPU fronts
+
+	struct spinlock cp_lock;		// Protects everything below
+	const char *cp_name;
+	size_t cp_size;				// Object size requested
+	size_t cp_linkoff;			// Offset of free-list link in an object
+	size_t cp_stride;			// Distance between objects in a slab
+	size_t cp_first;			// Offset of the first object in a slab
+	uint32_t cp_perslab;			// Objects per slab
+	void (*cp_ctor)(void *obj);		// Constructor, or NULL
+
+	struct kmem_slab *cp_partial;		// Slabs with free objects
+	struct kmem_slab *cp_full;		// Slabs with none
+	uint32_t cp_nslabs;			// Slabs (pages) owned by the cache
+	uint32_t cp_nempty;			// Slabs with no objects in use
+
+	// Statistics
+	uint32_t cp_allocs;			// Objects handed out of the slabs
+	uint32_t cp_frees;			// Objects returned to the slabs
+
+	struct kmem_cache *cp_next;		// Next cache in kmem_caches
+};
+
+void	kmem_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, void (*ctor)(void *obj));
+void	kmem_cache_destroy(struct kmem_cache *cp);
+void *	kmem_cache_alloc(struct kmem_cache *cp);
+void	kmem_cache_free(struct kmem_cache *cp, void *obj);
+void	kmem_print_stats(void);
+
+#endif	// !JOS_KERN_SLAB_H
@@ -13,6 +13,7 @@
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/pci.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -254,7 +255,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
-//	-E_NO_MEM if there's no memory to allocate any necessary page tables.
+//	-E_NO_MEM if there's no memory to allocate any necessary page tables,
+//		or to fill in srcva if it is a demand-zero reservation.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
 	     envid_t dstenvid, void *dstva, int perm)
@@ -281,6 +283,9 @@ sys_page_map(envid_t srcenvid, void *srcva,
 		return -E_INVAL;
 	}
 
+	if ((rc = page_demand_fill(src_e->env_pgdir, srcva)) < 0)
+		return rc;
+
 	src_pp = page_lookup(src_e->env_pgdir, srcva, &src_pte);
 	if (!src_pp || (perm & PTE_W && !(*src_pte & PTE_W)))
 		return -E_INVAL;
@@ -316,9 +321,128 @@ sys_page_unmap(envid_t envid, void *va)
 	return 0;
 }
 
+// Reserve [va, va+len) in the address space of 'envid' as demand-zero
+// memory with permission 'perm'.  No physical pages are allocated: the
+// kernel maps a zeroed page at each address the first time it is touched,
+// without calling the env's page fault upcall.
+// 'len' is rounded up to a multiple of PGSIZE.
+// If a page is already mapped in the range, it is unmapped as a side
+// effect.
+//
+// perm -- same restrictions as in sys_page_alloc.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned, or [va, va+len) is not
+//		entirely below UTOP.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if there's no memory to allocate any necessary page tables.
+static int
+sys_page_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	struct Env *e = NULL;
+	uintptr_t addr = 0, end = 0;
+	int rc = 0;
+
+	end = (uintptr_t)va + ROUNDUP(len, PGSIZE);
+	if ((perm & ~PTE_SYSCALL) != 0 || (perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P) ||
+		(uintptr_t)va % PGSIZE != 0 ||
+		end > UTOP || end < (uintptr_t)va)
+	{
+		return -E_INVAL;
+	}
+
+	if ((rc = envid2env(envid, &e, 1)) != 0)
+		return rc;
+
+	for (addr = (uintptr_t)va; addr < end; addr += PGSIZE)
+	{
+		if ((rc = page_reserve(e->env_pgdir, (void *)addr, perm)) < 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+// Copy the resource usage of environment 'envid' to 'ru'.
+// Any environment's usage may be read.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+static int
+sys_env_getrusage(envid_t envid, struct Rusage *ru)
+{
+	struct Env *e = NULL;
+	int rc = 0;
+
+	if ((rc = envid2env(envid, &e, 0)) != 0)
+		return rc;
+
+	user_mem_assert(curenv, ru, sizeof(*ru), PTE_U | PTE_W);
+	*ru = e->env_rusage;
+
+	return 0;
+}
+
+// Return the physical address 'va' maps to in the caller's address
+// space, for setting up DMA.  Demand-zero pages are filled in first.
+// Only environments with I/O privilege, which can program DMA engines
+// anyway, may ask.
+//
+// Returns the physical address on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller does not have I/O privilege.
+//	-E_INVAL if va >= UTOP, or nothing is mapped at va.
+//	-E_NO_MEM if a demand-zero page could not be filled.
+static int
+sys_page_phys(void *va)
+{
+	struct PageInfo *pp = NULL;
+
+	if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3)
+		return -E_BAD_ENV;
+	if ((uintptr_t)va >= UTOP)
+		return -E_INVAL;
+
+	if (page_demand_fill(curenv->env_pgdir, va) < 0)
+		return -E_NO_MEM;
+	if (!(pp = page_lookup(curenv->env_pgdir, va, NULL)))
+		return -E_INVAL;
+
+	return page2pa(pp) | PGOFF(va);
+}
+
+// Return the I/O port base of the bus-master IDE DMA registers.
+//
+// Returns -E_NOT_SUPP if there is no bus-master IDE controller.
+static int
+sys_ide_bmbase(void)
+{
+	return pci_ide_bmbase ? pci_ide_bmbase : -E_NOT_SUPP;
+}
+
+// Ask to be notified of IRQ 'irq' from the device this environment
+// drives.  Each interrupt arrives as an IPC from envid 0 whose value is
+// 'irq' (see irq_notify).  Only environments with I/O privilege may ask.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the caller does not have I/O privilege.
+//	-E_INVAL if the kernel handles 'irq' itself, or another
+//		environment is already notified of it.
+static int
+sys_irq_listen(int irq)
+{
+	if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3)
+		return -E_BAD_ENV;
+
+	return irq_listen(irq, curenv);
+}
+
 // Try to send 'value' to the target env 'envid'.
-// If srcva < UTOP, then also send page currently mapped at 'srcva',
-// so that receiver gets a duplicate mapping of the same page.
+// If srcva < UTOP, then also send the npages pages currently mapped
+// from 'srcva' on, so that the receiver gets duplicate mappings of the
+// same pages.  The receiver takes at most as many pages as it asked
+// for; the rest are not sent.
 //
 // The send fails with a return value of -E_IPC_NOT_RECV if the
 // target is not blocked, waiting for an IPC.
@@ -330,13 +454,14 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_perm is set to 'perm' if pages were transferred, 0 otherwise;
+//    env_ipc_npages is set to the number of pages transferred.
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
 // sys_ipc_recv function ever actually return?)
 //
-// If the sender wants to send a page but the receiver isn't asking for one,
-// then no page mapping is transferred, but no error occurs.
+// If the sender wants to send pages but the receiver isn't asking for
+// any, then no page mapping is transferred, but no error occurs.
 // The ipc only happens when no errors occur.
 //
 // Returns 0 on success, < 0 on error.
@@ -345,21 +470,26 @@ sys_page_unmap(envid_t envid, void *va)
 //		(No need to check permissions.)
 //	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
 //		or another environment managed to send first.
-//	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
+//	-E_INVAL if srcva < UTOP but srcva is not page-aligned, or the
+//		pages run past UTOP.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
-//	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
-//		address space.
-//	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
-//		current environment's address space.
-//	-E_NO_MEM if there's not enough memory to map srcva in envid's
-//		address space.
+//	-E_INVAL if srcva < UTOP but a page to send is not mapped in the
+//		caller's address space.
+//	-E_INVAL if (perm & PTE_W), but a page to send is read-only in
+//		the current environment's address space.
+//	-E_NO_MEM if there's not enough memory to map the pages in envid's
+//		address space, or to fill in a page to send if it is a
+//		demand-zero reservation.
 static int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+sys_ipc_try_send_pages(envid_t envid, uint32_t value, void *srcva,
+		       size_t npages, unsigned perm)
 {
 	struct Env *target_env = NULL;
 	struct PageInfo *pp = NULL;
 	pte_t *env_pte = NULL;
+	char *src = srcva, *dst;
+	size_t i, n = 0;
 	int rc = 0;
 
 	if (envid2env(envid, &target_env, 0) != 0)
@@ -374,29 +504,47 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 
 	if ((uintptr_t)srcva < UTOP && target_env->env_ipc_dstva != NULL)
 	{
-		if ((uintptr_t)srcva % PGSIZE != 0 || (perm & ~PTE_SYSCALL) != 0)
-		{
-			return -E_INVAL;
-		}
-
-		pp = page_lookup(curenv->env_pgdir, srcva, &env_pte);
-
-		if (!pp)
+		n = MIN(npages, target_env->env_ipc_npages);
+		dst = target_env->env_ipc_dstva;
+		if ((uintptr_t)srcva % PGSIZE != 0 || (perm & ~PTE_SYSCALL) != 0
+		    || n > (UTOP - (uintptr_t)srcva) / PGSIZE)
 		{
 			return -E_INVAL;
 		}
 
-		if (perm & PTE_W && !(*env_pte & PTE_W))
+		// Check all the pages before mapping any of them
+		for (i = 0; i < n; i++)
 		{
-			return -E_INVAL;
+			if ((rc = page_demand_fill(curenv->env_pgdir, src + i * PGSIZE)) < 0)
+			{
+				return rc;
+			}
+
+			pp = page_lookup(curenv->env_pgdir, src + i * PGSIZE, &env_pte);
+
+			if (!pp)
+			{
+				return -E_INVAL;
+			}
+
+			if (perm & PTE_W && !(*env_pte & PTE_W))
+			{
+				return -E_INVAL;
+			}
 		}
 
-		if (page_insert(target_env->env_pgdir, pp, target_env->env_ipc_dstva, perm) < 0)
+		for (i = 0; i < n; i++)
 		{
-			return -E_NO_MEM;
+			pp = page_lookup(curenv->env_pgdir, src + i * PGSIZE, &env_pte);
+			if (page_insert(target_env->env_pgdir, pp, dst + i * PGSIZE, perm) < 0)
+			{
+				while (i-- > 0)
+					page_remove(target_env->env_pgdir, dst + i * PGSIZE);
+				return -E_NO_MEM;
+			}
 		}
 
-		target_env->env_ipc_perm = perm;
+		target_env->env_ipc_perm = n ? perm : 0;
 	}
 	else
 	{
@@ -406,35 +554,63 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 	target_env->env_ipc_recving = 0;
 	target_env->env_ipc_from = curenv->env_id;
 	target_env->env_ipc_value = value;
+	target_env->env_ipc_npages = n;
 	target_env->env_status = ENV_RUNNABLE;
 
 	return 0;
 }
 
+// Send 'value', and the page at 'srcva' if it is below UTOP.
+// See sys_ipc_try_send_pages.
+static int
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	return sys_ipc_try_send_pages(envid, value, srcva, 1, perm);
+}
+
 // Block until a value is ready.  Record that you want to receive
-// using the env_ipc_recving and env_ipc_dstva fields of struct Env,
-// mark yourself not runnable, and then give up the CPU.
+// using the env_ipc_recving, env_ipc_dstva and env_ipc_npages fields
+// of struct Env, mark yourself not runnable, and then give up the CPU.
 //
-// If 'dstva' is < UTOP, then you are willing to receive a page of data.
-// 'dstva' is the virtual address at which the sent page should be mapped.
+// If 'dstva' is < UTOP, then you are willing to receive up to npages
+// pages of data, mapped from 'dstva' on.
 //
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
-//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned, or the
+//		pages run past UTOP.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv_pages(void *dstva, size_t npages)
 {
-	if ((uintptr_t)dstva < UTOP)
+	if ((uintptr_t)dstva < UTOP && npages > 0)
 	{
-		if ((uintptr_t)dstva % PGSIZE != 0)
+		if ((uintptr_t)dstva % PGSIZE != 0
+		    || npages > (UTOP - (uintptr_t)dstva) / PGSIZE)
 			return -E_INVAL;
 
 		curenv->env_ipc_dstva = dstva;
+		curenv->env_ipc_npages = npages;
 	}
 	else
 	{
 		curenv->env_ipc_dstva = NULL;
+		curenv->env_ipc_npages = 0;
+	}
+
+	// Report a pending IRQ notification without blocking
+	if (curenv->env_irq_pending)
+	{
+		int irq = 0;
+
+		while (!(curenv->env_irq_pending & (1 << irq)))
+			irq++;
+		curenv->env_irq_pending &= ~(1 << irq);
+		curenv->env_ipc_from = 0;
+		curenv->env_ipc_value = irq;
+		curenv->env_ipc_perm = 0;
+		curenv->env_ipc_npages = 0;
+		return 0;
 	}
 
 	curenv->env_ipc_recving = 1;
@@ -444,6 +620,14 @@ sys_ipc_recv(void *dstva)
 	sched_yield();
 }
 
+// Block until a value is ready, willing to receive a page at 'dstva'
+// if it is below UTOP.  See sys_ipc_recv_pages.
+static int
+sys_ipc_recv(void *dstva)
+{
+	return sys_ipc_recv_pages(dstva, 1);
+}
+
 // Return the current time.
 static int
 sys_time_msec(void)
@@ -475,6 +659,8 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 {
 	// Call the function corresponding to the 'syscallno' parameter.
 	// Return any appropriate return value.
+	curenv->env_rusage.ru_syscalls++;
+
 	switch (syscallno) {
 		case SYS_cputs:
 			sys_cputs((const char *)a1, a2);
@@ -512,6 +698,20 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 			return (int32_t)sys_tx_packet((char *)a1, (int)a2);
 		case SYS_rx_packet:
 			return (int32_t)sys_rx_packet((char *)a1);
+		case SYS_page_reserve:
+			return (int32_t)sys_page_reserve((envid_t)a1, (void *)a2, (size_t)a3, (int)a4);
+		case SYS_env_getrusage:
+			return (int32_t)sys_env_getrusage((envid_t)a1, (struct Rusage *)a2);
+		case SYS_page_phys:
+			return (int32_t)sys_page_phys((void *)a1);
+		case SYS_ide_bmbase:
+			return (int32_t)sys_ide_bmbase();
+		case SYS_irq_listen:
+			return (int32_t)sys_irq_listen((int)a1);
+		case SYS_ipc_try_send_pages:
+			return (int32_t)sys_ipc_try_send_pages((envid_t)a1, (uint32_t)a2, (void *)a3, (size_t)a4, (unsigned)a5);
+		case SYS_ipc_recv_pages:
+			return (int32_t)sys_ipc_recv_pages((void *)a1, (size_t)a2);
 		default:
 			return -E_INVAL;
 	}
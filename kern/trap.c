@@ -1,6 +1,7 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
@@ -230,6 +231,8 @@ trap_dispatch(struct Trapframe *tf)
 		// Be careful! In multiprocessors, clock interrupts are
 		// triggered on every CPU.
 		time_tick();
+		if (curenv)
+			curenv->env_rusage.ru_ticks++;
 
 		lapic_eoi();
 		sched_yield();
@@ -249,6 +252,17 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
+	// Pass other device interrupts on to the environment driving
+	// the device, if there is one.  The master PIC ends its
+	// interrupts itself, but the slave is not in automatic-EOI mode
+	// and delivers nothing more until it is told this one is done.
+	if (tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno < IRQ_OFFSET + MAX_IRQS
+	    && irq_notify(tf->tf_trapno - IRQ_OFFSET)) {
+		if (tf->tf_trapno >= IRQ_OFFSET + 8)
+			irq_eoi();
+		return;
+	}
+
 	// Unexpected trap: The user process or the kernel has a bug.
 	print_trapframe(tf);
 	if (tf->tf_cs == GD_KT)
@@ -259,6 +273,60 @@ trap_dispatch(struct Trapframe *tf)
 	}
 }
 
+// Environment to notify of each IRQ, or 0
+static envid_t irq_envs[MAX_IRQS];
+
+//
+// Ask for environment 'e' to be notified of IRQ 'irq', and unmask it.
+// Returns 0 on success, -E_INVAL if the kernel handles 'irq' itself or
+// another live environment has claimed it.
+//
+int
+irq_listen(int irq, struct Env *e)
+{
+	struct Env *owner;
+
+	if (irq < 0 || irq >= MAX_IRQS || irq == IRQ_TIMER || irq == IRQ_KBD
+	    || irq == IRQ_SERIAL || irq == IRQ_SPURIOUS || irq == IRQ_SLAVE)
+		return -E_INVAL;
+	if (irq_envs[irq] && irq_envs[irq] != e->env_id
+	    && envid2env(irq_envs[irq], &owner, 0) == 0)
+		return -E_INVAL;
+
+	irq_envs[irq] = e->env_id;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+	return 0;
+}
+
+//
+// Notify the environment listening for IRQ 'irq'.  The notification
+// arrives as an IPC from envid 0 whose value is the IRQ number: at once
+// if the environment is blocked in sys_ipc_recv, otherwise at its next
+// sys_ipc_recv.
+// Returns 1 if there was an environment to notify, 0 if not.
+//
+int
+irq_notify(int irq)
+{
+	struct Env *e;
+
+	if (!irq_envs[irq] || envid2env(irq_envs[irq], &e, 0) < 0)
+		return 0;
+
+	if (!e->env_ipc_recving) {
+		e->env_irq_pending |= 1 << irq;
+		return 1;
+	}
+
+	e->env_ipc_recving = 0;
+	e->env_ipc_from = 0;
+	e->env_ipc_value = irq;
+	e->env_ipc_perm = 0;
+	e->env_ipc_npages = 0;
+	e->env_status = ENV_RUNNABLE;
+	return 1;
+}
+
 void
 trap(struct Trapframe *tf)
 {
@@ -323,6 +391,7 @@ void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
+	int r;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
@@ -335,6 +404,18 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// First touch of a demand-zero reservation: map a zeroed page and
+	// restart the faulting instruction without involving the env.
+	if ((r = page_demand_fill(curenv->env_pgdir, (void *)fault_va)) > 0)
+		return;
+	if (r < 0)
+	{
+		cprintf("[%08x] out of memory filling demand-zero va %08x\n",
+			curenv->env_id, fault_va);
+		env_destroy(curenv);
+		return;
+	}
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -370,6 +451,8 @@ page_fault_handler(struct Trapframe *tf)
 		uintptr_t uxstack_esp = UXSTACKTOP;
 		struct UTrapframe *u = NULL;
 
+		curenv->env_rusage.ru_upcalls++;
+
 		if (tf->tf_esp >= UXSTACKBOTTOM && tf->tf_esp < UXSTACKTOP)
 		{
 			// We are already on a user page fault. Next fault will be placed 4 bytes underneath
@@ -1,11 +1,22 @@
 #include <inc/fs.h>
 #include <inc/string.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 #define debug 0
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// Return the file server's environment ID.
+static envid_t
+fsenv(void)
+{
+	static envid_t fsenv;
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+	return fsenv;
+}
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -15,16 +26,12 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
-
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
+	ipc_send(fsenv(), type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
 	return ipc_recv(NULL, dstva, NULL);
 }
 
@@ -103,6 +110,169 @@ devfile_flush(struct Fd *fd)
 	return fsipc(FSREQ_FLUSH, NULL);
 }
 
+// Reads and writes too large for fsipcbuf go in bulk, as a run of up to
+// FSBULK_PAGES pages passed with a single IPC.  The windows the pages
+// are passed in are set up the first time they are needed.
+static char *bulk_rdwin;	// FSBULK_PAGES
+static char *bulk_wrwin;	// a request page, then FSBULK_PAGES
+
+// Ask for the block cache pages that hold the next 'n' bytes of 'fd',
+// at most *npages of them, to be mapped read-only from 'pg' on.  Store
+// the number of pages in *npages and the offset of the data in the
+// first one in *pgoff.  Returns the number of bytes, or < 0 on error.
+static int
+fsipc_read_pages(struct Fd *fd, size_t n, void *pg, size_t *npages, int *pgoff)
+{
+	int r;
+
+	fsipcbuf.read.req_fileid = fd->fd_file.id;
+	fsipcbuf.read.req_n = n;
+	ipc_send(fsenv(), FSREQ_READ_PAGES, &fsipcbuf, PTE_P | PTE_W | PTE_U);
+	if ((r = ipc_recv_pages(NULL, pg, npages, NULL)) > 0)
+		*pgoff = fsipcbuf.readPagesRet.ret_offset % BLKSIZE;
+	return r;
+}
+
+// Read at most 'n' bytes from 'fd' into 'buf' with FSREQ_READ_PAGES.
+// The server answers with the pages of its block cache that hold the
+// data, so the data is copied only once, from those into 'buf'.
+// Returns -E_NO_MEM if there is no room for the window.
+static ssize_t
+devfile_read_pages(struct Fd *fd, void *buf, size_t n)
+{
+	size_t npages;
+	int r, pgoff;
+
+	if (!bulk_rdwin && !(bulk_rdwin = malloc(FSBULK_PAGES * PGSIZE)))
+		return -E_NO_MEM;
+
+	npages = FSBULK_PAGES;
+	if ((r = fsipc_read_pages(fd, n, bulk_rdwin, &npages, &pgoff)) <= 0)
+		return r;
+	assert(r <= n);
+	memmove(buf, bulk_rdwin + pgoff, r);
+	return r;
+}
+
+// Write at most 'n' bytes from 'buf' to 'fd' with FSREQ_WRITE_PAGES,
+// which sends the data in the pages after the request page.  Returns
+// -E_NO_MEM if there is no room for the window.
+static ssize_t
+devfile_write_pages(struct Fd *fd, const void *buf, size_t n)
+{
+	struct Fsreq_write_pages *req;
+
+	if (!bulk_wrwin && !(bulk_wrwin = malloc((1 + FSBULK_PAGES) * PGSIZE)))
+		return -E_NO_MEM;
+
+	n = MIN(n, FSBULK_PAGES * PGSIZE);
+	req = (struct Fsreq_write_pages *) bulk_wrwin;
+	req->req_fileid = fd->fd_file.id;
+	req->req_n = n;
+	memmove(bulk_wrwin + PGSIZE, buf, n);
+	ipc_send_pages(fsenv(), FSREQ_WRITE_PAGES, bulk_wrwin,
+		       1 + ROUNDUP(n, PGSIZE) / PGSIZE, PTE_P | PTE_W | PTE_U);
+	return ipc_recv(NULL, NULL, NULL);
+}
+
+// Reads of up to a page are served from a small cache of file pages,
+// so a program that reads a file in small pieces, or reads the same
+// file over and over, does not ask the file server each time.  The
+// cached pages are the server's block cache pages, mapped read-only
+// with FSREQ_MAP, so writes to the file show through them; a write, a
+// resize, or a file created in a directory bumps fd_file.gen on every
+// Fd page open on the file or directory, and a page cached under
+// another generation is fetched again.
+#define FCACHE_PAGES	16
+
+static struct fcpage {
+	int fc_fileid;
+	uint32_t fc_gen;
+	off_t fc_offset;	// page-aligned offset in the file
+	int fc_len;		// bytes of the file in the page, 0 if unused
+	uint32_t fc_stamp;	// when last used
+} fcache[FCACHE_PAGES];
+static char *fcache_va;		// a page for each entry
+static uint32_t fcache_clock;
+
+#define FCPAGE2VA(fc)	(fcache_va + ((fc) - fcache) * PGSIZE)
+
+// Find the page of 'fd' at page-aligned offset 'off' in the cache,
+// fetching it in place of the least recently used page if it is not
+// there.  Returns the number of bytes of the file in the page, which
+// is 0 at end-of-file, or < 0 on error.
+static int
+fcache_get(struct Fd *fd, off_t off, struct fcpage **fc_store)
+{
+	struct fcpage *fc, *victim;
+	uint32_t gen;
+	int r;
+
+	// Take the generation before asking for the page, so a write that
+	// races with the request leaves the page looking stale, not fresh
+	gen = fd->fd_file.gen;
+	victim = fcache;
+	for (fc = fcache; fc < fcache + FCACHE_PAGES; fc++) {
+		if (fc->fc_len && fc->fc_fileid == fd->fd_file.id
+		    && fc->fc_offset == off && fc->fc_gen == gen)
+			goto found;
+		if (!fc->fc_len || (victim->fc_len && fc->fc_stamp < victim->fc_stamp))
+			victim = fc;
+	}
+
+	*fc_store = fc = victim;
+	fc->fc_len = 0;
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = off;
+	if ((r = fsipc(FSREQ_MAP, FCPAGE2VA(fc))) <= 0)
+		return r;
+	fc->fc_fileid = fd->fd_file.id;
+	fc->fc_gen = gen;
+	fc->fc_offset = off;
+	fc->fc_len = r;
+	fc->fc_stamp = ++fcache_clock;
+	return r;
+
+found:
+	fc->fc_stamp = ++fcache_clock;
+	*fc_store = fc;
+	return fc->fc_len;
+}
+
+// Read at most 'n' bytes from 'fd' into 'buf' out of the page cache,
+// and update the seek position.  Returns -E_NO_MEM if there is no room
+// for the cache.
+static ssize_t
+devfile_read_cached(struct Fd *fd, void *buf, size_t n)
+{
+	struct fcpage *fc;
+	off_t off = fd->fd_offset;
+	size_t m, tot;
+	int r;
+
+	if (!fcache_va && !(fcache_va = malloc(FCACHE_PAGES * PGSIZE)))
+		return -E_NO_MEM;
+
+	tot = 0;
+	while (tot < n) {
+		if ((r = fcache_get(fd, ROUNDDOWN(off, PGSIZE), &fc)) < 0) {
+			if (tot == 0)
+				return r;
+			break;
+		}
+		if (r <= off % PGSIZE)
+			break;
+		m = MIN(n - tot, r - off % PGSIZE);
+		memmove((char *) buf + tot, FCPAGE2VA(fc) + off % PGSIZE, m);
+		tot += m;
+		off += m;
+		if (r < PGSIZE)		// the file ends in this page
+			break;
+	}
+	fd->fd_offset = off;
+	return tot;
+}
+
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
 //
 // Returns:
@@ -117,6 +287,13 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// system server.
 	int r;
 
+	if (n > sizeof(fsipcbuf.readRet.ret_buf)
+	    && (r = devfile_read_pages(fd, buf, n)) != -E_NO_MEM)
+		return r;
+	if (n <= sizeof(fsipcbuf.readRet.ret_buf)
+	    && (r = devfile_read_cached(fd, buf, n)) != -E_NO_MEM)
+		return r;
+
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
@@ -143,6 +320,9 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	int r;
 	int buf_size = sizeof(fsipcbuf.write.req_buf);
 
+	if (n > buf_size && (r = devfile_write_pages(fd, buf, n)) != -E_NO_MEM)
+		return r;
+
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
 	fsipcbuf.write.req_n = buf_size >= n ? n : buf_size;
 	memmove(fsipcbuf.write.req_buf, buf, fsipcbuf.write.req_n);
@@ -150,6 +330,14 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	return fsipc(FSREQ_WRITE, NULL);
 }
 
+static void
+stat_copy(struct Stat *st, struct Fsret_stat *ret)
+{
+	strcpy(st->st_name, ret->ret_name);
+	st->st_size = ret->ret_size;
+	st->st_isdir = ret->ret_isdir;
+}
+
 static int
 devfile_stat(struct Fd *fd, struct Stat *st)
 {
@@ -158,9 +346,7 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 	fsipcbuf.stat.req_fileid = fd->fd_file.id;
 	if ((r = fsipc(FSREQ_STAT, NULL)) < 0)
 		return r;
-	strcpy(st->st_name, fsipcbuf.statRet.ret_name);
-	st->st_size = fsipcbuf.statRet.ret_size;
-	st->st_isdir = fsipcbuf.statRet.ret_isdir;
+	stat_copy(st, &fsipcbuf.statRet);
 	return 0;
 }
 
@@ -174,6 +360,149 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 }
 
 
+// The page fault handler the program had when mmap first needed one
+// for copy-on-write pages, if any.
+extern void (*_pgfault_handler)(struct UTrapframe *utf);
+static void (*mmap_prev_pgfault)(struct UTrapframe *utf);
+
+// Give a write to a copy-on-write page its private copy, and pass any
+// other fault on to the program's own handler.
+static void
+mmap_pgfault(struct UTrapframe *utf)
+{
+	void *addr = (void *) utf->utf_fault_va;
+
+	if ((utf->utf_err & FEC_WR) && (uvpd[PDX(addr)] & PTE_P)
+	    && (uvpt[PGNUM(addr)] & PTE_COW))
+		cow_pgfault(utf);
+	else if (mmap_prev_pgfault)
+		mmap_prev_pgfault(utf);
+	else
+		panic("page fault at va %08x, eip %08x", addr, utf->utf_eip);
+}
+
+// Map 'len' bytes of the open file 'fdnum', starting at file offset
+// 'offset', at virtual address 'va'.  Both 'va' and 'offset' must be
+// page-aligned.  The pages are the file server's block-cache pages
+// themselves, so no data is copied.
+//
+// If 'perm' includes PTE_W the mapping is private: the pages are mapped
+// copy-on-write and the first write to each one makes a private copy;
+// a page fault handler the program has installed still gets every
+// other fault.  Otherwise the mapping is read-only.  Pages past end-of-file are
+// demand-zero.
+//
+// Returns 0 on success, < 0 on error.  On error, any pages already
+// mapped are unmapped again.
+int
+mmap(void *va, size_t len, int perm, int fdnum, off_t offset)
+{
+	int r;
+	size_t i;
+	struct Fd *fd;
+
+	if ((uintptr_t) va % PGSIZE != 0 || offset % PGSIZE != 0)
+		return -E_INVAL;
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+
+	if ((perm & PTE_W) && _pgfault_handler != cow_pgfault
+	    && _pgfault_handler != mmap_pgfault) {
+		mmap_prev_pgfault = _pgfault_handler;
+		set_pgfault_handler(mmap_pgfault);
+	}
+
+	for (i = 0; i < len; i += PGSIZE) {
+		fsipcbuf.map.req_fileid = fd->fd_file.id;
+		fsipcbuf.map.req_offset = offset + i;
+		if ((r = fsipc(FSREQ_MAP, va + i)) < 0)
+			goto error;
+		if (r == 0) {
+			// At end-of-file: the rest of the mapping is zeros
+			if ((r = sys_page_reserve(0, va + i, len - i, PTE_P|PTE_U|(perm & PTE_W))) < 0)
+				goto error;
+			break;
+		}
+		if ((perm & PTE_W)
+		    && (r = sys_page_map(0, va + i, 0, va + i, PTE_P|PTE_U|PTE_COW)) < 0)
+			goto error;
+	}
+	return 0;
+
+error:
+	munmap(va, i);
+	return r;
+}
+
+// Send 'len' bytes of file 'fdnum', from 'offset' on, to socket 's',
+// and leave the file's seek position after them.  The block cache pages
+// that hold the data go from the file server to the network server, and
+// the data is sent from them, so it is never copied on the way.
+// The pages alternate between two windows, so that one batch is on its
+// way while the next is fetched and queued behind it; the network
+// server holds on to each batch until it is acknowledged.
+// Returns the number of bytes sent, which is less than 'len' only at
+// end-of-file, or < 0 on error.
+ssize_t
+sendfile(int s, int fdnum, off_t offset, size_t len)
+{
+	static char *wins[2];	// each a request page, then NSBULK_PAGES
+	struct Fd *sfd, *fd;
+	size_t tot, npages[2] = { 0, 0 };
+	int r, n, pgoff, w;
+	bool more = 0;
+
+	if ((r = fd_lookup(s, &sfd)) < 0 || (r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (sfd->fd_dev_id != devsock.dev_id || fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	for (w = 0; w < 2; w++)
+		if (!wins[w] && !(wins[w] = malloc((1 + NSBULK_PAGES) * PGSIZE)))
+			return -E_NO_MEM;
+
+	fd->fd_offset = offset;
+	for (tot = 0, w = 0; tot < len; tot += n, w = !w) {
+		npages[w] = NSBULK_PAGES;
+		n = MIN(len - tot, NSBULK_PAGES * PGSIZE - fd->fd_offset % PGSIZE);
+		if ((n = fsipc_read_pages(fd, n, wins[w] + PGSIZE, &npages[w], &pgoff)) <= 0) {
+			npages[w] = 0;
+			if (n < 0 && tot == 0)
+				return n;
+			break;
+		}
+		more = tot + n < len;
+		if ((r = nsipc_sendpages(sfd->fd_sock.sockid, wins[w], npages[w],
+					 pgoff, n, more)) < 0)
+			return r;
+	}
+	// The file ended early, after pages that went out with more to
+	// come: wait for them too, since the caller may close the socket
+	if (more && (r = nsipc_sendpages(sfd->fd_sock.sockid, wins[w], 0, 0, 0, 0)) < 0)
+		return r;
+
+	// Let go of the block cache pages
+	for (w = 0; w < 2; w++)
+		munmap(wins[w] + PGSIZE, npages[w] * PGSIZE);
+	return tot;
+}
+
+// Unmap [va, va+len), which was mapped by mmap.
+int
+munmap(void *va, size_t len)
+{
+	int r;
+	size_t i;
+
+	if ((uintptr_t) va % PGSIZE != 0)
+		return -E_INVAL;
+	for (i = 0; i < len; i += PGSIZE)
+		if ((r = sys_page_unmap(0, va + i)) < 0)
+			return r;
+	return 0;
+}
+
 // Synchronize disk with buffer cache
 int
 sync(void)
@@ -184,3 +513,281 @@ sync(void)
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
+
+// Get the file server's counters
+int
+fsstats(struct Fsstats *st)
+{
+	int r;
+
+	if ((r = fsipc(FSREQ_STATS, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.statsRet;
+	return 0;
+}
+
+
+// Reading directories.  Each FSREQ_READDIR fills a page with as many
+// of the directory's files as fit, so a directory takes one round trip
+// per page of names rather than one per file.
+struct Dir {
+	int d_fd;
+	int d_pos;		// next entry in d_buf
+	int d_len;		// bytes in d_buf
+	char d_buf[PGSIZE];
+};
+
+// Open the directory path for reading with readdir, and store it in
+// *dp.  Returns 0 on success, < 0 on error.
+int
+opendir(const char *path, struct Dir **dp)
+{
+	struct Dir *d;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return fd;
+	if (!(d = malloc(sizeof(*d)))) {
+		close(fd);
+		return -E_NO_MEM;
+	}
+	d->d_fd = fd;
+	d->d_pos = d->d_len = 0;
+	*dp = d;
+	return 0;
+}
+
+// Read the next file in d into *st.
+//
+// Returns 1 on success, 0 at the end of the directory, < 0 on error.
+int
+readdir(struct Dir *d, struct Stat *st)
+{
+	struct Fsdirent *de;
+	struct Fd *fd;
+	int r;
+
+	if (d->d_pos == d->d_len) {
+		if ((r = fd_lookup(d->d_fd, &fd)) < 0)
+			return r;
+		if (fd->fd_dev_id != devfile.dev_id)
+			return -E_NOT_SUPP;
+		fsipcbuf.readdir.req_fileid = fd->fd_file.id;
+		if ((r = fsipc(FSREQ_READDIR, NULL)) <= 0)
+			return r;
+		memmove(d->d_buf, fsipcbuf.readdirRet.ret_buf, r);
+		d->d_pos = 0;
+		d->d_len = r;
+	}
+
+	de = (struct Fsdirent *) (d->d_buf + d->d_pos);
+	d->d_pos += de->d_reclen;
+	strcpy(st->st_name, de->d_name);
+	st->st_size = de->d_size;
+	st->st_isdir = (de->d_type == FTYPE_DIR);
+	st->st_dev = &devfile;
+	return 1;
+}
+
+void
+closedir(struct Dir *d)
+{
+	close(d->d_fd);
+	free(d);
+}
+
+
+// Asynchronous file requests.
+//
+// Each outstanding request has a page of its own, which is sent to the
+// file server with the request code and the request's slot number in
+// the IPC value.  The server does not answer with an IPC; it posts the
+// slot number and the result to our completion ring, a page it keeps
+// mapped.  So up to FSRING_SIZE requests can be in flight at once, and
+// they complete in whatever order the server finishes them.  Requests
+// on the same file descriptor may complete out of order too.
+//
+// The ring is a shared page at a fixed address, so a fork leaves it
+// shared with the server rather than copy-on-write; a forked child
+// replaces it with a page of its own when it first uses it.
+#define AIORINGVA	0xCFFFF000	// just below the file descriptor table
+
+struct aio_slot {
+	union Fsipc *s_ipc;	// request page, allocated on first use
+	unsigned s_code;	// request code, or 0 if the slot is free
+	uint32_t s_tag;		// the caller's tag
+	void *s_buf;		// where read data or a Stat go
+};
+
+static struct Fsring *const aio_ring = (struct Fsring *) AIORINGVA;
+static struct aio_slot aio_slots[FSRING_SIZE];
+static uint32_t aio_nbusy;
+static envid_t aio_envid;	// environment the ring is set up for, or 0
+
+// Give the file server a completion ring, unless this environment has
+// done so already.  A child of a forked environment starts over with
+// none of its parent's requests.
+static int
+aio_setup(void)
+{
+	int i, r;
+
+	if (aio_envid == thisenv->env_id)
+		return 0;
+	if ((r = sys_page_alloc(0, aio_ring, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		return r;
+	for (i = 0; i < FSRING_SIZE; i++)
+		aio_slots[i].s_code = 0;
+	aio_nbusy = 0;
+
+	ipc_send(fsenv(), FSREQ_RING, aio_ring, PTE_P | PTE_W | PTE_U);
+	if ((r = ipc_recv(NULL, NULL, NULL)) < 0)
+		return r;
+	aio_envid = thisenv->env_id;
+	return 0;
+}
+
+// Find a free slot for a request on fdnum and set it up, with its page
+// zeroed for the caller to fill in.
+static int
+aio_alloc(int fdnum, unsigned code, uint32_t tag, void *buf,
+	  struct aio_slot **ps, struct Fd **pfd)
+{
+	struct aio_slot *s;
+	int r;
+
+	if ((r = fd_lookup(fdnum, pfd)) < 0)
+		return r;
+	if ((*pfd)->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if ((r = aio_setup()) < 0)
+		return r;
+
+	for (s = aio_slots; s < aio_slots + FSRING_SIZE && s->s_code; s++)
+		/* do nothing */;
+	if (s == aio_slots + FSRING_SIZE)
+		return -E_NO_MEM;
+	if (!s->s_ipc && !(s->s_ipc = malloc(PGSIZE)))
+		return -E_NO_MEM;
+
+	memset(s->s_ipc, 0, sizeof(s->s_ipc->read));
+	s->s_code = code;
+	s->s_tag = tag;
+	s->s_buf = buf;
+	*ps = s;
+	return 0;
+}
+
+static void
+aio_send(struct aio_slot *s)
+{
+	aio_nbusy++;
+	ipc_send(fsenv(), FSREQ_MKASYNC(s->s_code, s - aio_slots), s->s_ipc,
+		 PTE_P | PTE_W | PTE_U);
+}
+
+// Start reading at most n bytes from fdnum at its current position into
+// buf.  The file position moves on when the read is done.  tag comes
+// back with the completion, whose result is as for read.
+// Returns 0 if the read is on its way, -E_NO_MEM if FSRING_SIZE
+// requests are outstanding already, or < 0 on another error.
+int
+aio_read(int fdnum, void *buf, size_t n, uint32_t tag)
+{
+	struct aio_slot *s;
+	struct Fd *fd;
+	int r;
+
+	if ((r = aio_alloc(fdnum, FSREQ_READ, tag, buf, &s, &fd)) < 0)
+		return r;
+	s->s_ipc->read.req_fileid = fd->fd_file.id;
+	s->s_ipc->read.req_n = MIN(n, sizeof(s->s_ipc->readRet.ret_buf));
+	aio_send(s);
+	return 0;
+}
+
+// Start writing at most one page of buf to fdnum at its current
+// position.  buf may be reused as soon as this returns.
+int
+aio_write(int fdnum, const void *buf, size_t n, uint32_t tag)
+{
+	struct aio_slot *s;
+	struct Fd *fd;
+	int r;
+
+	if ((r = aio_alloc(fdnum, FSREQ_WRITE, tag, NULL, &s, &fd)) < 0)
+		return r;
+	s->s_ipc->write.req_fileid = fd->fd_file.id;
+	s->s_ipc->write.req_n = MIN(n, sizeof(s->s_ipc->write.req_buf));
+	memmove(s->s_ipc->write.req_buf, buf, s->s_ipc->write.req_n);
+	aio_send(s);
+	return 0;
+}
+
+// Start a stat of fdnum into *st.
+int
+aio_stat(int fdnum, struct Stat *st, uint32_t tag)
+{
+	struct aio_slot *s;
+	struct Fd *fd;
+	int r;
+
+	if ((r = aio_alloc(fdnum, FSREQ_STAT, tag, st, &s, &fd)) < 0)
+		return r;
+	s->s_ipc->stat.req_fileid = fd->fd_file.id;
+	st->st_dev = &devfile;
+	aio_send(s);
+	return 0;
+}
+
+// Take a completion off the ring if there is one, storing the request's
+// tag in *tag and its result in *result.  Returns 1 if it did, 0 if no
+// request has completed.
+int
+aio_poll(uint32_t *tag, int *result)
+{
+	volatile struct Fscomp *c;
+	struct aio_slot *s;
+
+	while (aio_envid == thisenv->env_id
+	       && aio_ring->r_head != aio_ring->r_tail) {
+		c = &aio_ring->r_comp[aio_ring->r_head % FSRING_SIZE];
+		s = &aio_slots[c->c_tag % FSRING_SIZE];
+		*result = c->c_result;
+		aio_ring->r_head++;
+		if (!s->s_code)
+			continue;
+
+		if (s->s_code == FSREQ_READ && *result > 0)
+			memmove(s->s_buf, s->s_ipc->readRet.ret_buf, *result);
+		else if (s->s_code == FSREQ_STAT && *result == 0)
+			stat_copy(s->s_buf, &s->s_ipc->statRet);
+		*tag = s->s_tag;
+		s->s_code = 0;
+		aio_nbusy--;
+		return 1;
+	}
+	return 0;
+}
+
+// Wait for a request to complete and take its completion, as aio_poll.
+// Returns 0, or -E_INVAL if no requests are outstanding.
+int
+aio_wait(uint32_t *tag, int *result)
+{
+	while (!aio_poll(tag, result)) {
+		if (aio_nbusy == 0)
+			return -E_INVAL;
+
+		// Ask to be woken, then look again in case a completion
+		// came in first.  If the server has already taken the
+		// request back, its wakeup is on the way and must be
+		// received.
+		xchg(&aio_ring->r_waiting, 1);
+		if (aio_ring->r_head != aio_ring->r_tail
+		    && xchg(&aio_ring->r_waiting, 0))
+			continue;
+		ipc_recv(NULL, NULL, NULL);
+	}
+	return 0;
+}
@@ -3,19 +3,16 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 // Assembly language pgfault entrypoint defined in lib/pfentry.S.
 extern void _pgfault_upcall(void);
 
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
+// Also used by mmap for private writable file mappings.
 //
-static void
-pgfault(struct UTrapframe *utf)
+void
+cow_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t err = utf->utf_err;
@@ -84,6 +81,25 @@ duppage(envid_t envid, unsigned pn)
 	void *addr = (void *)(pn * PGSIZE);
 	envid_t srcid = sys_getenvid();
 
+	if (!(pte & PTE_P) && (pte & PTE_DZ))
+	{
+		// Untouched demand-zero page.  A shared one has to be filled
+		// in so both envs see the same page; a private one can just
+		// be reserved in the child too.
+		if (!(pte & PTE_SHARE))
+		{
+			r = sys_page_reserve(envid, addr, PGSIZE, (pte & PTE_SYSCALL) | PTE_P);
+			if (r != 0)
+				panic("Error - sys_page_reserve failed %e", r);
+			return 0;
+		}
+
+		r = sys_page_alloc(srcid, addr, (pte & PTE_SYSCALL) | PTE_P);
+		if (r != 0)
+			panic("Error - sys_page_alloc failed %e", r);
+		pte = uvpt[pn];
+	}
+
 	if (((pte & PTE_COW) || (pte & PTE_W)) && !(pte & PTE_SHARE))
 	{
 		perm = ((pte & ~PTE_W) | PTE_COW) & PTE_SYSCALL;
@@ -130,7 +146,7 @@ fork(void)
 	envid_t envid;
 	uint32_t pn = 0;
 
-	set_pgfault_handler(pgfault);
+	set_pgfault_handler(cow_pgfault);
 
 	envid = sys_exofork();
 	if (envid < 0)
@@ -154,7 +170,7 @@ fork(void)
 
 			if (pn == PGNUM(UXSTACKTOP - PGSIZE)) continue;		// Page is the user exception stack
 			else if (pn >= PGNUM(UTOP - PGSIZE)) continue;		// Page is above UTOP
-			else if (!(uvpt[pn] & PTE_P)) continue;				// No page present
+			else if (!(uvpt[pn] & (PTE_P | PTE_DZ))) continue;	// No page present or reserved
 			duppage(envid, pn);
 		}
 	}
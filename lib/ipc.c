@@ -84,6 +84,44 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 		panic("Error - failed to send ipc to envid %d with error %e", to_env, rc);
 }
 
+// Like ipc_send, but send the npages pages starting at pg.  The
+// receiver takes as many of them as it asked for.
+void
+ipc_send_pages(envid_t to_env, uint32_t val, void *pg, size_t npages, int perm)
+{
+	int rc;
+
+	while ((rc = sys_ipc_try_send_pages(to_env, val, pg ? pg : (void *) UTOP,
+					    npages, perm)) == -E_IPC_NOT_RECV)
+		sys_yield();
+	if (rc != 0)
+		panic("Error - failed to send ipc to envid %d with error %e", to_env, rc);
+}
+
+// Like ipc_recv, but take up to *npages pages starting at pg, and
+// store the number actually received in *npages.
+int32_t
+ipc_recv_pages(envid_t *from_env_store, void *pg, size_t *npages, int *perm_store)
+{
+	int rc;
+
+	if ((rc = sys_ipc_recv_pages(pg ? pg : (void *) UTOP, *npages)) < 0) {
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+		*npages = 0;
+		return rc;
+	}
+
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	*npages = thisenv->env_ipc_npages;
+	return thisenv->env_ipc_value;
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
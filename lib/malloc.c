@@ -2,139 +2,330 @@
 #include <inc/lib.h>
 
 /*
- * Simple malloc/free.
+ * Size-class malloc/free.
  *
- * Uses the address space to do most of the hard work.
- * The address space from mbegin to mend is scanned
- * in order.  Pages are allocated, used to fill successive
- * malloc requests, and then left alone.  Free decrements
- * a ref count maintained in the page; the page is freed
- * when the ref count hits zero.
+ * The heap is the address space from MBEGIN to MEND, described by
+ * mpages[], one entry per heap page.  mpages[] takes the first pages of
+ * the heap itself, reserved demand-zero, so only the part describing
+ * pages in use costs memory.
  *
- * If we need to allocate a large amount (more than a page)
- * we can't put a ref count at the end of each page,
- * so we mark the pte entry with the bit PTE_CONTINUED.
+ * Requests up to MAXSMALL bytes are rounded up to one of the size
+ * classes in mclasses[].  Each small page holds objects of a single
+ * class and keeps its own free list, threaded through the free objects.
+ * A class keeps a list of its pages that have free objects, so malloc
+ * and free are a handful of pointer operations and freed space is
+ * reused right away.  Once all of a page's objects are free the page is
+ * unmapped, except that each class keeps one empty page to absorb churn.
+ *
+ * Classes get address space MBATCH pages at a time with a single
+ * sys_page_reserve.  The pages are demand-zero, so a page only costs
+ * memory once its class starts carving it into objects.
+ *
+ * Larger requests get a run of whole pages, also reserved with one
+ * system call, and dropped with one on free.
  */
 enum
 {
-	MAXMALLOC = 1024*1024	/* max size of one allocated chunk */
+	MAXMALLOC = 1024*1024,	/* max size of one allocated chunk */
+	MAXSMALL = 2048,	/* largest size class */
+	MBATCH = 8		/* pages a class reserves at a time */
+};
+
+#define MBEGIN	((uint8_t*) 0x08000000)
+#define MEND	((uint8_t*) 0x10000000)
+#define MNPAGES	((0x10000000 - 0x08000000) / PGSIZE)
+
+/* What a heap page is used for */
+enum
+{
+	MP_FREE = 0,	/* nothing */
+	MP_SMALL,	/* objects of size class mp_class */
+	MP_LARGE,	/* first page of a large chunk of mp_count pages */
+	MP_CONT,	/* later page of a large chunk */
+	MP_TABLE	/* part of mpages[] */
+};
+
+struct mpage {
+	struct mpage *mp_next;		/* next page on the class's list */
+	struct mpage **mp_pprev;	/* link pointing at us */
+	void *mp_free;			/* first free object */
+	uint16_t mp_count;		/* objects in use, or large chunk pages */
+	uint8_t mp_kind;
+	uint8_t mp_class;
+};
+
+struct mclass {
+	size_t mc_size;			/* object size */
+	struct mpage *mc_partial;	/* carved pages with free objects */
+	struct mpage *mc_fresh;		/* reserved pages not carved yet */
+	int mc_nfresh;
+	int mc_nempty;			/* pages on mc_partial with none in use */
+
+	/* statistics */
+	uint32_t mc_npages;		/* pages owned, carved or not */
+	uint32_t mc_inuse;		/* objects handed out */
+	uint32_t mc_allocs;
+	uint32_t mc_frees;
 };
 
-#define PTE_CONTINUED 0x200
+static struct mclass mclasses[] = {
+	{ 16 }, { 32 }, { 48 }, { 64 }, { 96 }, { 128 }, { 192 },
+	{ 256 }, { 384 }, { 512 }, { 768 }, { 1024 }, { MAXSMALL }
+};
+
+/* size class of an n-byte request, indexed by (n + 15) / 16 */
+static uint8_t msize2class[MAXSMALL / 16 + 1];
+static bool minited;
+
+static struct mpage *const mpages = (struct mpage *) MBEGIN;
+#define MTABLEPAGES	(ROUNDUP(MNPAGES * sizeof(struct mpage), PGSIZE) / PGSIZE)
+static int mcursor;	/* where the next search for free pages starts */
 
-static uint8_t *mbegin = (uint8_t*) 0x08000000;
-static uint8_t *mend   = (uint8_t*) 0x10000000;
-static uint8_t *mptr;
+static struct {
+	uint32_t npages;	/* pages in large chunks */
+	uint32_t inuse;		/* large chunks handed out */
+	uint32_t allocs;
+	uint32_t frees;
+} mlarge;
+
+#define MPAGE2VA(mp)	(MBEGIN + ((mp) - mpages) * PGSIZE)
+#define VA2MPAGE(va)	(&mpages[((uint8_t*) (va) - MBEGIN) / PGSIZE])
 
 static int
-isfree(void *v, size_t n)
+malloc_init(void)
 {
-	uintptr_t va, end_va = (uintptr_t) v + n;
+	int i, c, r;
 
-	for (va = (uintptr_t) v; va < end_va; va += PGSIZE)
-		if (va >= (uintptr_t) mend
-		    || ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P)))
-			return 0;
-	return 1;
+	if ((r = sys_page_reserve(0, mpages, MTABLEPAGES * PGSIZE,
+				  PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	for (i = 0; i < MTABLEPAGES; i++)
+		mpages[i].mp_kind = MP_TABLE;
+	mcursor = MTABLEPAGES;
+
+	for (i = c = 0; i < ARRAY_SIZE(msize2class); i++) {
+		while (mclasses[c].mc_size < i * 16)
+			c++;
+		msize2class[i] = c;
+	}
+	minited = 1;
+	return 0;
 }
 
-void*
-malloc(size_t n)
+static void
+mpage_list_insert(struct mpage **head, struct mpage *mp)
 {
-	int i, cont;
-	int nwrap;
-	uint32_t *ref;
-	void *v;
-
-	if (mptr == 0)
-		mptr = mbegin;
+	if ((mp->mp_next = *head))
+		(*head)->mp_pprev = &mp->mp_next;
+	*head = mp;
+	mp->mp_pprev = head;
+}
 
-	n = ROUNDUP(n, 4);
+static void
+mpage_list_remove(struct mpage *mp)
+{
+	if (mp->mp_next)
+		mp->mp_next->mp_pprev = mp->mp_pprev;
+	*mp->mp_pprev = mp->mp_next;
+	mp->mp_next = 0;
+	mp->mp_pprev = 0;
+}
 
-	if (n >= MAXMALLOC)
-		return 0;
+/*
+ * Find n free heap pages in a row, starting where the last search
+ * left off, and reserve them.  The caller sets their mp_kind.
+ */
+static struct mpage *
+mpages_alloc(int n)
+{
+	int i, nscanned;
+	struct mpage *mp;
 
-	if ((uintptr_t) mptr % PGSIZE){
-		/*
-		 * we're in the middle of a partially
-		 * allocated page - can we add this chunk?
-		 * the +4 below is for the ref count.
-		 */
-		ref = (uint32_t*) (ROUNDUP(mptr, PGSIZE) - 4);
-		if ((uintptr_t) mptr / PGSIZE == (uintptr_t) (mptr + n - 1 + 4) / PGSIZE) {
-			(*ref)++;
-			v = mptr;
-			mptr += n;
-			return v;
+	for (nscanned = 0; nscanned < 2 * MNPAGES; ) {
+		if (mcursor + n > MNPAGES) {
+			nscanned += MNPAGES - mcursor;
+			mcursor = 0;
+			continue;
+		}
+		mp = &mpages[mcursor];
+		for (i = 0; i < n && mp[i].mp_kind == MP_FREE; i++)
+			;
+		if (i == n) {
+			if (sys_page_reserve(0, MPAGE2VA(mp), n * PGSIZE,
+					     PTE_P|PTE_U|PTE_W) < 0)
+				return 0;	/* out of page tables */
+			mcursor += n;
+			return mp;
 		}
-		/*
-		 * stop working on this page and move on.
-		 */
-		free(mptr);	/* drop reference to this page */
-		mptr = ROUNDDOWN(mptr + PGSIZE, PGSIZE);
+		mcursor += i + 1;
+		nscanned += i + 1;
 	}
+	return 0;	/* out of address space */
+}
+
+/*
+ * Give back n heap pages in a row.  Reserving them again drops their
+ * memory with a single system call.
+ */
+static void
+mpages_free(struct mpage *mp, int n)
+{
+	int i;
+
+	sys_page_reserve(0, MPAGE2VA(mp), n * PGSIZE, PTE_P|PTE_U|PTE_W);
+	for (i = 0; i < n; i++)
+		mp[i].mp_kind = MP_FREE;
+}
 
-	/*
-	 * now we need to find some address space for this chunk.
-	 * if it's less than a page we leave it open for allocation.
-	 * runs of more than a page can't have ref counts so we
-	 * flag the PTE entries instead.
-	 */
-	nwrap = 0;
-	while (1) {
-		if (isfree(mptr, n + 4))
-			break;
-		mptr += PGSIZE;
-		if (mptr == mend) {
-			mptr = mbegin;
-			if (++nwrap == 2)
-				return 0;	/* out of address space */
+/*
+ * Give class mc another page of free objects, reserving a new batch
+ * of pages if it has run out.
+ */
+static struct mpage *
+mclass_grow(struct mclass *mc)
+{
+	struct mpage *mp;
+	uint8_t *va;
+	int i, n;
+
+	if (mc->mc_nfresh == 0) {
+		n = MBATCH;
+		if (!(mp = mpages_alloc(n)) && !(mp = mpages_alloc(n = 1)))
+			return 0;
+		for (i = 0; i < n; i++) {
+			mp[i].mp_kind = MP_SMALL;
+			mp[i].mp_class = mc - mclasses;
+			mp[i].mp_count = 0;
 		}
+		mc->mc_fresh = mp;
+		mc->mc_nfresh = n;
+		mc->mc_npages += n;
 	}
 
-	/*
-	 * allocate at mptr - the +4 makes sure we allocate a ref count.
-	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
-		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;	/* out of physical memory */
-		}
+	mp = mc->mc_fresh++;
+	mc->mc_nfresh--;
+
+	/* chain back to front so objects go out in address order */
+	va = MPAGE2VA(mp);
+	mp->mp_free = 0;
+	for (i = PGSIZE / mc->mc_size; i-- > 0; ) {
+		*(void**) (va + i * mc->mc_size) = mp->mp_free;
+		mp->mp_free = va + i * mc->mc_size;
 	}
+	mpage_list_insert(&mc->mc_partial, mp);
+	mc->mc_nempty++;
+	return mp;
+}
+
+static void*
+malloc_large(size_t n)
+{
+	struct mpage *mp;
+	int i, npages;
 
-	ref = (uint32_t*) (mptr + i - 4);
-	*ref = 2;	/* reference for mptr, reference for returned block */
-	v = mptr;
-	mptr += n;
+	if (n >= MAXMALLOC)
+		return 0;
+
+	npages = ROUNDUP(n, PGSIZE) / PGSIZE;
+	if (!(mp = mpages_alloc(npages)))
+		return 0;
+	mp->mp_kind = MP_LARGE;
+	mp->mp_count = npages;
+	for (i = 1; i < npages; i++)
+		mp[i].mp_kind = MP_CONT;
+
+	mlarge.npages += npages;
+	mlarge.inuse++;
+	mlarge.allocs++;
+	return MPAGE2VA(mp);
+}
+
+void*
+malloc(size_t n)
+{
+	struct mclass *mc;
+	struct mpage *mp;
+	void *v;
+
+	if (!minited && malloc_init() < 0)
+		return 0;
+	if (n > MAXSMALL)
+		return malloc_large(n);
+
+	mc = &mclasses[msize2class[(n + 15) / 16]];
+
+	if (!(mp = mc->mc_partial) && !(mp = mclass_grow(mc)))
+		return 0;
+
+	v = mp->mp_free;
+	mp->mp_free = *(void**) v;
+	if (mp->mp_count++ == 0)
+		mc->mc_nempty--;
+	if (!mp->mp_free)
+		mpage_list_remove(mp);
+
+	mc->mc_inuse++;
+	mc->mc_allocs++;
 	return v;
 }
 
 void
 free(void *v)
 {
-	uint8_t *c;
-	uint32_t *ref;
+	struct mpage *mp;
+	struct mclass *mc;
 
 	if (v == 0)
 		return;
-	assert(mbegin <= (uint8_t*) v && (uint8_t*) v < mend);
+	assert(MBEGIN <= (uint8_t*) v && (uint8_t*) v < MEND);
 
-	c = ROUNDDOWN(v, PGSIZE);
+	mp = VA2MPAGE(v);
+	switch (mp->mp_kind) {
+	case MP_SMALL:
+		mc = &mclasses[mp->mp_class];
+		if (((uint8_t*) v - MPAGE2VA(mp)) % mc->mc_size != 0)
+			panic("free: %08x is not the start of a chunk", v);
 
-	while (uvpt[PGNUM(c)] & PTE_CONTINUED) {
-		sys_page_unmap(0, c);
-		c += PGSIZE;
-		assert(mbegin <= c && c < mend);
-	}
+		if (!mp->mp_free)
+			mpage_list_insert(&mc->mc_partial, mp);
+		*(void**) v = mp->mp_free;
+		mp->mp_free = v;
+		mc->mc_inuse--;
+		mc->mc_frees++;
 
-	/*
-	 * c is just a piece of this page, so dec the ref count
-	 * and maybe free the page.
-	 */
-	ref = (uint32_t*) (c + PGSIZE - 4);
-	if (--(*ref) == 0)
-		sys_page_unmap(0, c);
+		if (--mp->mp_count == 0 && ++mc->mc_nempty > 1) {
+			mpage_list_remove(mp);
+			mc->mc_nempty--;
+			mc->mc_npages--;
+			mpages_free(mp, 1);
+		}
+		return;
+
+	case MP_LARGE:
+		if ((uint8_t*) v != MPAGE2VA(mp))
+			panic("free: %08x is not the start of a chunk", v);
+		mlarge.npages -= mp->mp_count;
+		mlarge.inuse--;
+		mlarge.frees++;
+		mpages_free(mp, mp->mp_count);
+		return;
+
+	default:
+		panic("free: %08x was not allocated by malloc", v);
+	}
 }
 
+void
+malloc_stats(void)
+{
+	struct mclass *mc;
+
+	cprintf(" size  pages  in use   allocs    frees\n");
+	for (mc = mclasses; mc < mclasses + ARRAY_SIZE(mclasses); mc++)
+		if (mc->mc_allocs)
+			cprintf("%5d  %5d  %6d  %7d  %7d\n", mc->mc_size,
+				mc->mc_npages, mc->mc_inuse, mc->mc_allocs,
+				mc->mc_frees);
+	cprintf("large  %5d  %6d  %7d  %7d\n", mlarge.npages, mlarge.inuse,
+		mlarge.allocs, mlarge.frees);
+}
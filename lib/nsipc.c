@@ -8,6 +8,16 @@
 #define REQVA		0x0ffff000
 union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 
+// The network server's environment ID.
+static envid_t
+nsenv(void)
+{
+	static envid_t nsenv;
+	if (nsenv == 0)
+		nsenv = ipc_find_env(ENV_TYPE_NS);
+	return nsenv;
+}
+
 // Send an IP request to the network server, and wait for a reply.
 // The request body should be in nsipcbuf, and parts of the response
 // may be written back to nsipcbuf.
@@ -16,16 +26,12 @@ union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 nsipc(unsigned type)
 {
-	static envid_t nsenv;
-	if (nsenv == 0)
-		nsenv = ipc_find_env(ENV_TYPE_NS);
-
 	static_assert(sizeof(nsipcbuf) == PGSIZE);
 
 	if (debug)
 		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
+	ipc_send(nsenv(), type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
 	return ipc_recv(NULL, NULL, NULL);
 }
 
@@ -113,6 +119,24 @@ nsipc_send(int s, const void *buf, int size, unsigned int flags)
 	return nsipc(NSREQ_SEND);
 }
 
+// Send size bytes to socket s, starting offset bytes into the npages
+// pages that follow the request page pg.  The pages themselves go to
+// the network server, which sends from them without copying.  If 'more'
+// is set, this returns as soon as the data is queued and what was sent
+// before it is acknowledged; otherwise once all of it is.
+int
+nsipc_sendpages(int s, void *pg, int npages, int offset, int size, bool more)
+{
+	struct Nsreq_sendpages *req = pg;
+
+	req->req_s = s;
+	req->req_offset = offset;
+	req->req_size = size;
+	req->req_more = more;
+	ipc_send_pages(nsenv(), NSREQ_SENDPAGES, pg, 1 + npages, PTE_P|PTE_U);
+	return ipc_recv(NULL, NULL, NULL);
+}
+
 int
 nsipc_socket(int domain, int type, int protocol)
 {
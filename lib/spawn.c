@@ -278,9 +278,26 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 
 	for (i = 0; i < memsz; i += PGSIZE) {
 		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
+			// the rest of the segment is bss: reserve it demand-zero
+			if ((r = sys_page_reserve(child, (void*) (va + i), memsz - i, perm)) < 0)
 				return r;
+			break;
+		} else if (!(perm & PTE_W) && (i + PGSIZE <= filesz || memsz <= filesz)) {
+			// read-only page straight from the file: map the file
+			// server's block-cache page rather than reading it
+			// through IPC, but give the child a copy, so that a
+			// later write to the file cannot change its text
+			if ((r = mmap(UTEMP, PGSIZE, 0, fd, fileoffset + i)) < 0)
+				return r;
+			if ((r = sys_page_alloc(0, UTEMP2, PTE_P|PTE_U|PTE_W)) < 0) {
+				sys_page_unmap(0, UTEMP);
+				return r;
+			}
+			memmove(UTEMP2, UTEMP, PGSIZE);
+			sys_page_unmap(0, UTEMP);
+			if ((r = sys_page_map(0, UTEMP2, child, (void*) (va + i), perm)) < 0)
+				panic("spawn: sys_page_map text: %e", r);
+			sys_page_unmap(0, UTEMP2);
 		} else {
 			// from file
 			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
@@ -85,6 +85,48 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_page_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_page_reserve, 1, envid, (uint32_t) va, len, perm, 0);
+}
+
+int
+sys_env_getrusage(envid_t envid, struct Rusage *ru)
+{
+	return syscall(SYS_env_getrusage, 1, envid, (uint32_t) ru, 0, 0, 0);
+}
+
+int
+sys_page_phys(void *va)
+{
+	return syscall(SYS_page_phys, 0, (uint32_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_ide_bmbase(void)
+{
+	return syscall(SYS_ide_bmbase, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_irq_listen(int irq)
+{
+	return syscall(SYS_irq_listen, 0, irq, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_try_send_pages(envid_t envid, uint32_t value, void *srcva, size_t npages, int perm)
+{
+	return syscall(SYS_ipc_try_send_pages, 0, envid, value, (uint32_t) srcva, npages, perm);
+}
+
+int
+sys_ipc_recv_pages(void *dstva, size_t npages)
+{
+	return syscall(SYS_ipc_recv_pages, 1, (uint32_t) dstva, npages, 0, 0, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
 int
@@ -634,6 +634,70 @@ lwip_send(int s, const void *data, int size, unsigned int flags)
   return (err==ERR_OK?size:-1);
 }
 
+/**
+ * Like lwip_send on a TCP socket, but the data is not copied: the
+ * segments sent refer to it where it is, so the caller must keep it
+ * until lwip_nocopy_wait(s, *done) returns.  This returns once the data
+ * is queued and everything sent before it has been acknowledged, so a
+ * caller that alternates between two buffers keeps the connection busy
+ * without holding more than two.  The socket must not be closed while
+ * data is queued.
+ */
+int
+lwip_send_nocopy(int s, const void *data, int size, u32_t *done)
+{
+  struct lwip_socket *sock;
+  struct tcp_pcb *pcb;
+  err_t err = ERR_OK;
+  u32_t start;
+
+  LWIP_DEBUGF(SOCKETS_DEBUG, ("lwip_send_nocopy(%d, data=%p, size=%d)\n",
+                              s, data, size));
+
+  sock = get_socket(s);
+  if (!sock)
+    return -1;
+
+  if (sock->conn->type!=NETCONN_TCP) {
+    sock_set_errno(sock, err_to_errno(ERR_ARG));
+    return -1;
+  }
+
+  if ((pcb = sock->conn->pcb.tcp) == NULL) {
+    sock_set_errno(sock, err_to_errno(ERR_CONN));
+    return -1;
+  }
+  start = *done = pcb->snd_lbb;
+  if (size > 0)
+    err = netconn_write(sock->conn, data, size, NETCONN_NOCOPY);
+
+  /* Even after an error, what was queued may still refer to data */
+  if ((pcb = sock->conn->pcb.tcp) != NULL)
+    *done = pcb->snd_lbb;
+  lwip_nocopy_wait(s, start);
+
+  LWIP_DEBUGF(SOCKETS_DEBUG, ("lwip_send_nocopy(%d) err=%d size=%d\n", s, err, size));
+  sock_set_errno(sock, err_to_errno(err));
+  return (err==ERR_OK?size:-1);
+}
+
+/**
+ * Wait until the remote side has acknowledged everything before
+ * sequence number done, as set by lwip_send_nocopy, or the connection
+ * is gone.
+ */
+void
+lwip_nocopy_wait(int s, u32_t done)
+{
+  struct lwip_socket *sock;
+  struct tcp_pcb *pcb;
+
+  while ((sock = get_socket(s)) != NULL && sock->conn != NULL
+         && (pcb = sock->conn->pcb.tcp) != NULL
+         && TCP_SEQ_LT(pcb->lastack, done))
+    sys_msleep(1);
+}
+
 int
 lwip_sendto(int s, const void *data, int size, unsigned int flags,
        struct sockaddr *to, socklen_t tolen)
@@ -8,9 +8,12 @@
 #define TIMER_INTERVAL 250
 #define E1000_PACKET_SIZE_BYTES 1518
 
-// Virtual address at which to receive page mappings containing client requests.
+// Virtual address at which to receive page mappings containing client
+// requests: QUEUE_SIZE slots, each with room for a request page and the
+// NSBULK_PAGES that may follow it.
 #define QUEUE_SIZE	20
-#define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
+#define REQSLOT		((1 + NSBULK_PAGES) * PGSIZE)
+#define REQVA		(0x0ffff000 - QUEUE_SIZE * REQSLOT)
 
 /* timer.c */
 void timer(envid_t ns_envid, uint32_t initial_to);
@@ -64,7 +64,7 @@ get_buffer(void) {
 		return 0;
 	}
 
-	va = (void *)(REQVA + i * PGSIZE);
+	va = (void *)(REQVA + i * REQSLOT);
 	buse[i] = 1;
 
 	return va;
@@ -72,7 +72,7 @@ get_buffer(void) {
 
 static void
 put_buffer(void *va) {
-	int i = ((uint32_t)va - REQVA) / PGSIZE;
+	int i = ((uint32_t)va - REQVA) / REQSLOT;
 	buse[i] = 0;
 }
 
@@ -181,13 +181,17 @@ struct st_args {
 	int32_t reqno;
 	uint32_t whom;
 	union Nsipc *req;
+	size_t npages;
 };
 
 static void
 serve_thread(uint32_t a) {
 	struct st_args *args = (struct st_args *)a;
 	union Nsipc *req = args->req;
-	int r;
+	size_t i;
+	int r, s;
+	u32_t done;
+	bool replied = 0;
 
 	switch (args->reqno) {
 	case NSREQ_ACCEPT:
@@ -226,6 +230,27 @@ serve_thread(uint32_t a) {
 		r = lwip_send(req->send.req_s, &req->send.req_buf,
 			      req->send.req_size, req->send.req_flags);
 		break;
+	case NSREQ_SENDPAGES:
+		// In size_t, so that no sum of the two can wrap
+		if (args->npages == 0 || req->sendPages.req_offset < 0
+		    || req->sendPages.req_size < 0
+		    || (size_t) req->sendPages.req_offset > (args->npages - 1) * PGSIZE
+		    || (size_t) req->sendPages.req_size
+		       > (args->npages - 1) * PGSIZE - req->sendPages.req_offset) {
+			r = -E_INVAL;
+			break;
+		}
+		s = req->sendPages.req_s;
+		r = lwip_send_nocopy(s, (char *) req + PGSIZE + req->sendPages.req_offset,
+				     req->sendPages.req_size, &done);
+		// With more to come, let the client get the next pages ready
+		// while these go out.  They stay mapped until acknowledged.
+		if (r >= 0 && req->sendPages.req_more) {
+			ipc_send(args->whom, r, 0, 0);
+			replied = 1;
+		}
+		lwip_nocopy_wait(s, done);
+		break;
 	case NSREQ_SOCKET:
 		r = lwip_socket(req->socket.req_domain, req->socket.req_type,
 				req->socket.req_protocol);
@@ -246,11 +271,12 @@ serve_thread(uint32_t a) {
 		perror(buf);
 	}
 
-	if (args->reqno != NSREQ_INPUT)
+	if (args->reqno != NSREQ_INPUT && !replied)
 		ipc_send(args->whom, r, 0, 0);
 
 	put_buffer(args->req);
-	sys_page_unmap(0, (void*) args->req);
+	for (i = 0; i < args->npages; i++)
+		sys_page_unmap(0, (char *) args->req + i * PGSIZE);
 	free(args);
 }
 
@@ -259,6 +285,7 @@ serve(void) {
 	int32_t reqno;
 	uint32_t whom;
 	int i, perm;
+	size_t npages;
 	void *va;
 
 	while (1) {
@@ -270,7 +297,8 @@ serve(void) {
 
 		perm = 0;
 		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+		npages = 1 + NSBULK_PAGES;
+		reqno = ipc_recv_pages((int32_t *) &whom, (void *) va, &npages, &perm);
 		if (debug) {
 			cprintf("ns req %d from %08x\n", reqno, whom);
 		}
@@ -297,6 +325,7 @@ serve(void) {
 		args->reqno = reqno;
 		args->whom = whom;
 		args->req = va;
+		args->npages = npages;
 
 		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
 		thread_yield(); // let the thread created run
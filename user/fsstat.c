@@ -0,0 +1,29 @@
+#include <inc/lib.h>
+
+// Print the file server's counters.
+
+void
+umain(int argc, char **argv)
+{
+	int r;
+	struct Fsstats st;
+
+	if ((r = fsstats(&st)) < 0)
+		panic("fsstats: %e", r);
+
+	printf("block cache: %d/%d blocks, %d hits, %d misses, %d read ahead, %d evictions, %d writebacks\n",
+	       st.bc_resident, st.bc_limit, st.bc_hits, st.bc_misses,
+	       st.bc_readahead, st.bc_evictions, st.bc_writebacks);
+	printf("flusher: %d runs, %d blocks dirty\n",
+	       st.bc_flushes, st.bc_dirty);
+	printf("path cache: %d hits, %d misses\n",
+	       st.dc_hits, st.dc_misses);
+	printf("workers: %d requests waited for the disk\n", st.wk_waits);
+	printf("open files: %d open, %d opens, %d closes\n",
+	       st.of_inuse, st.of_opens, st.of_closes);
+	printf("tmpfs: %d/%d blocks\n", st.tf_blocks, st.tf_limit);
+	printf("journal: %d commits, %d blocks, %d replayed\n",
+	       st.jn_commits, st.jn_blocks, st.jn_replayed);
+	printf("disk: %d requests in %d DMA commands\n",
+	       st.ide_requests, st.ide_commands);
+}
@@ -74,20 +74,12 @@ send_header(struct http_request *req, int code)
 }
 
 static int
-send_data(struct http_request *req, int fd)
+send_data(struct http_request *req, int fd, off_t size)
 {
-	char buf[256];
-	int r = 0;
-
-	while ((r = read(fd, buf, 256)) > 0)
-	{
-		if (write(req->sock, buf, r) != r)
-		{
-			return -1;
-		}
-	}
+	if (sendfile(req->sock, fd, 0, size) != size)
+		return -1;
 
-	return r;
+	return 0;
 }
 
 static int
@@ -259,7 +251,7 @@ send_file(struct http_request *req)
 	if ((r = send_header_fin(req)) < 0)
 		goto end;
 
-	r = send_data(req, fd);
+	r = send_data(req, fd, file_size);
 
 end:
 	close(fd);
@@ -22,18 +22,17 @@ ls(const char *path, const char *prefix)
 void
 lsdir(const char *path, const char *prefix)
 {
-	int fd, n;
-	struct File f;
+	int r;
+	struct Dir *d;
+	struct Stat st;
 
-	if ((fd = open(path, O_RDONLY)) < 0)
-		panic("open %s: %e", path, fd);
-	while ((n = readn(fd, &f, sizeof f)) == sizeof f)
-		if (f.f_name[0])
-			ls1(prefix, f.f_type==FTYPE_DIR, f.f_size, f.f_name);
-	if (n > 0)
-		panic("short read in directory %s", path);
-	if (n < 0)
-		panic("error reading directory %s: %e", path, n);
+	if ((r = opendir(path, &d)) < 0)
+		panic("open %s: %e", path, r);
+	while ((r = readdir(d, &st)) > 0)
+		ls1(prefix, st.st_isdir, st.st_size, st.st_name);
+	if (r < 0)
+		panic("error reading directory %s: %e", path, r);
+	closedir(d);
 }
 
 void
@@ -0,0 +1,51 @@
+// test demand-zero reservations made with sys_page_reserve
+
+#include <inc/lib.h>
+
+#define VA	((char *) 0xA0000000)
+#define LEN	(16 * PTSIZE)
+
+void
+umain(int argc, char **argv)
+{
+	int r, i;
+	envid_t child;
+
+	if ((r = sys_page_reserve(0, VA, LEN, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_reserve: %e", r);
+	for (i = 0; i < LEN; i += PGSIZE)
+		assert(!(uvpt[PGNUM(VA + i)] & PTE_P));
+	cprintf("reserve is good\n");
+
+	// Touch one page in every page table's worth of the range
+	for (i = 0; i < LEN; i += PTSIZE) {
+		assert(VA[i + 100] == 0);
+		VA[i + 100] = 'x';
+		assert(uvpt[PGNUM(VA + i)] & PTE_P);
+		assert(!(uvpt[PGNUM(VA + i + PGSIZE)] & PTE_P));
+	}
+	cprintf("demand fill is good\n");
+
+	// A forked child gets its own zero pages for untouched reservations
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		assert(VA[100] == 'x');
+		assert(VA[PGSIZE] == 0);
+		VA[PGSIZE] = 'c';
+		exit();
+	}
+	wait(child);
+	assert(VA[PGSIZE] == 0);
+	cprintf("fork of reservation is good\n");
+
+	// The kernel fills a reserved page it is asked to read
+	sys_page_reserve(0, VA, PGSIZE, PTE_P|PTE_U|PTE_W);
+	sys_cputs(VA, 0);
+	assert(uvpt[PGNUM(VA)] & PTE_P);
+
+	if ((r = sys_page_unmap(0, VA + PGSIZE)) < 0)
+		panic("sys_page_unmap: %e", r);
+	assert(!(uvpt[PGNUM(VA + PGSIZE)] & (PTE_P|PTE_DZ)));
+	cprintf("unmap of reservation is good\n");
+}
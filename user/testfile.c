@@ -3,6 +3,9 @@
 const char *msg = "This is the NEW message of the day!\n\n";
 
 #define FVA ((struct Fd*)0xCCCCC000)
+#define MVA ((char*)0xB0000000)
+
+static char bigbuf[(NDIRECT*3)*BLKSIZE];
 
 static int
 xopen(const char *path, int mode)
@@ -18,6 +21,24 @@ xopen(const char *path, int mode)
 	return ipc_recv(NULL, FVA, NULL);
 }
 
+// Is there a file called name in the directory open as fd?  Reads the
+// directory an entry at a time, so the reads go through the page cache.
+static bool
+dir_has(int fd, const char *name)
+{
+	struct File ent;
+	int r;
+
+	if ((r = seek(fd, 0)) < 0)
+		panic("seek: %e", r);
+	while ((r = readn(fd, &ent, sizeof(ent))) == sizeof(ent))
+		if (strcmp(ent.f_name, name) == 0)
+			return 1;
+	if (r < 0)
+		panic("read directory: %e", r);
+	return 0;
+}
+
 void
 umain(int argc, char **argv)
 {
@@ -26,6 +47,10 @@ umain(int argc, char **argv)
 	struct Fd fdcopy;
 	struct Stat st;
 	char buf[512];
+	int fds[8], seen, res;
+	struct Dir *dir;
+	uint32_t tag;
+	static char abuf[8][BLKSIZE];
 
 	// We open files manually first, to avoid the FD layer
 	if ((r = xopen("/not-found", O_RDONLY)) < 0 && r != -E_NOT_FOUND)
@@ -124,5 +149,131 @@ umain(int argc, char **argv)
 	}
 	close(f);
 	cprintf("large file is good\n");
+
+	// Move the same file in bulk, from an offset inside a block
+	if ((f = open("/big", O_RDONLY)) < 0)
+		panic("open /big: %e", f);
+	if ((r = seek(f, 100)) < 0 || (r = readn(f, bigbuf + 100, sizeof(bigbuf) - 100)) < 0)
+		panic("bulk read /big: %e", r);
+	close(f);
+	if ((f = open("/bulk", O_WRONLY|O_CREAT)) < 0)
+		panic("creat /bulk: %e", f);
+	if ((r = write(f, bigbuf, sizeof(bigbuf))) != sizeof(bigbuf))
+		panic("bulk write /bulk: %e", r);
+	close(f);
+	memset(bigbuf, 0, sizeof(bigbuf));
+	if ((f = open("/bulk", O_RDONLY)) < 0)
+		panic("open /bulk: %e", f);
+	if ((r = readn(f, bigbuf, sizeof(bigbuf))) != sizeof(bigbuf))
+		panic("bulk read /bulk returned %e", r);
+	for (i = sizeof(buf); i < sizeof(bigbuf); i += sizeof(buf))
+		if (*(int*)(bigbuf + i) != i)
+			panic("bulk read /bulk at %d has bad data %d", i, *(int*)(bigbuf + i));
+	close(f);
+	cprintf("bulk read and write is good\n");
+
+	// Small reads come from the page cache, which a write or a
+	// truncate through another descriptor must not leave stale
+	if ((f = open("/bulk", O_RDONLY)) < 0 || (i = open("/bulk", O_RDWR)) < 0)
+		panic("open /bulk: %e", f < 0 ? f : i);
+	if ((r = seek(f, PGSIZE)) < 0 || (r = readn(f, buf, 4)) != 4
+	    || *(int*)buf != PGSIZE)
+		panic("cached read /bulk: %e", r);
+	*(int*)buf = -1;
+	if ((r = seek(i, PGSIZE)) < 0 || (r = write(i, buf, 4)) != 4)
+		panic("write /bulk: %e", r);
+	if ((r = seek(f, PGSIZE)) < 0 || (r = readn(f, buf, 4)) != 4
+	    || *(int*)buf != -1)
+		panic("cached read /bulk after write: %e", r);
+	if ((r = ftruncate(i, PGSIZE)) < 0)
+		panic("ftruncate /bulk: %e", r);
+	if ((r = readn(f, buf, 4)) != 0)
+		panic("cached read /bulk after truncate returned %d", r);
+	close(i);
+	close(f);
+
+	// Nor may creating a file leave its directory stale
+	if ((f = open("/", O_RDONLY)) < 0)
+		panic("open /: %e", f);
+	if (dir_has(f, "dirgen"))
+		panic("/dirgen exists already");
+	if ((i = open("/dirgen", O_RDWR|O_CREAT|O_EXCL)) < 0)
+		panic("create /dirgen: %e", i);
+	close(i);
+	if (!dir_has(f, "dirgen"))
+		panic("cached read of / misses /dirgen");
+	close(f);
+	cprintf("read cache is good\n");
+
+	// The root directory lists both files, with their sizes
+	if ((r = opendir("/", &dir)) < 0)
+		panic("opendir /: %e", r);
+	seen = 0;
+	while ((r = readdir(dir, &st)) > 0)
+		if (strcmp(st.st_name, "big") == 0 && st.st_size == sizeof(bigbuf))
+			seen |= 1;
+		else if (strcmp(st.st_name, "bulk") == 0 && st.st_size == PGSIZE)
+			seen |= 2;
+	if (r < 0 || seen != 3)
+		panic("readdir /: %e, found %x", r, seen);
+	closedir(dir);
+	cprintf("readdir is good\n");
+
+	// Map the same file out of the block cache
+	if ((f = open("/big", O_RDONLY)) < 0)
+		panic("open /big: %e", f);
+	if ((r = mmap(MVA, (NDIRECT*3)*BLKSIZE + PGSIZE, PTE_W, f, 0)) < 0)
+		panic("mmap /big: %e", r);
+	for (i = 0; i < (NDIRECT*3)*BLKSIZE; i += sizeof(buf))
+		if (*(int*)(MVA + i) != i)
+			panic("mmap /big at %d has bad data %d", i, *(int*)(MVA + i));
+	if (MVA[(NDIRECT*3)*BLKSIZE] != 0)
+		panic("mmap /big past end-of-file is not zero");
+	*(int*)MVA = -1;
+	if ((r = readn(f, buf, sizeof(buf))) != sizeof(buf) || *(int*)buf != 0)
+		panic("private mmap write reached /big");
+	munmap(MVA, (NDIRECT*3)*BLKSIZE + PGSIZE);
+	close(f);
+	cprintf("mmap is good\n");
+
+	// Read a block from each of several descriptors at once
+	seen = 0;
+	for (i = 0; i < 8; i++) {
+		if ((fds[i] = open("/big", O_RDONLY)) < 0)
+			panic("open /big: %e", fds[i]);
+		if ((r = seek(fds[i], i * 3 * BLKSIZE)) < 0)
+			panic("seek /big: %e", r);
+		if ((r = aio_read(fds[i], abuf[i], BLKSIZE, i)) < 0)
+			panic("aio_read /big: %e", r);
+	}
+	while ((r = aio_wait(&tag, &res)) == 0) {
+		if (tag >= 8 || (seen & (1 << tag)))
+			panic("aio_wait returned bad tag %d", tag);
+		seen |= 1 << tag;
+		if (res != BLKSIZE || *(int*)abuf[tag] != tag * 3 * BLKSIZE)
+			panic("aio_read %d returned %d bytes of bad data", tag, res);
+	}
+	if (r != -E_INVAL || seen != 0xFF)
+		panic("aio_wait lost completions: %e, %x", r, seen);
+	if ((r = aio_stat(fds[0], &st, 9)) < 0 || aio_wait(&tag, &res) < 0
+	    || tag != 9 || res != 0 || st.st_size != (NDIRECT*3)*BLKSIZE)
+		panic("aio_stat /big: %e", r < 0 ? r : res);
+
+	// A forked child gets a ring of its own, and the parent keeps its
+	if ((r = fork()) < 0)
+		panic("fork: %e", r);
+	if (r == 0) {
+		if (aio_read(fds[1], abuf[1], BLKSIZE, 1) < 0
+		    || aio_wait(&tag, &res) < 0 || tag != 1 || res != BLKSIZE)
+			panic("aio_read /big in forked child");
+		exit();
+	}
+	wait(r);
+	if ((r = aio_read(fds[0], abuf[0], BLKSIZE, 0)) < 0
+	    || aio_wait(&tag, &res) < 0 || tag != 0 || res != BLKSIZE)
+		panic("aio_read /big after fork: %e", r < 0 ? r : res);
+	for (i = 0; i < 8; i++)
+		close(fds[i]);
+	cprintf("aio is good\n");
 }
 
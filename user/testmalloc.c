@@ -18,6 +18,8 @@ umain(int argc, char **argv)
 			n = strtol(buf + 7, 0, 0);
 			v = malloc(n);
 			printf("\t0x%x\n", (uintptr_t) v);
+		} else if (strcmp(buf, "stats") == 0) {
+			malloc_stats();
 		} else
 			printf("?unknown command\n");
 	}
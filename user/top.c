@@ -0,0 +1,31 @@
+#include <inc/lib.h>
+
+// Show the resource usage of every environment.
+
+static const char *status_names[] = {
+	[ENV_FREE] = "free",
+	[ENV_DYING] = "dying",
+	[ENV_RUNNABLE] = "run",
+	[ENV_RUNNING] = "cpu",
+	[ENV_NOT_RUNNABLE] = "wait",
+};
+
+void
+umain(int argc, char **argv)
+{
+	int i;
+	struct Rusage ru;
+	const volatile struct Env *e;
+
+	printf("   ENVID STATE   RUNS  TICKS SYSCALLS    RES MAXRES   DZ  UPCALLS\n");
+	for (i = 0; i < NENV; i++) {
+		e = &envs[i];
+		if (e->env_status == ENV_FREE
+		    || sys_env_getrusage(e->env_id, &ru) < 0)
+			continue;
+		printf("%08x %-5s %6d %6d %8d %6d %6d %4d %8d\n",
+		       e->env_id, status_names[e->env_status], e->env_runs,
+		       ru.ru_ticks, ru.ru_syscalls, ru.ru_resident,
+		       ru.ru_maxresident, ru.ru_dzfaults, ru.ru_upcalls);
+	}
+}